@@ -12,11 +12,143 @@
 #define FPS 30
 #define OUTPUT_BIT_RATE 96000
 
+// Snapshot stress run: synthetic packets pushed to the buffer while the readers take snapshots.
+#define STRESS_READERS 4
+#define STRESS_PACKETS 30000
+#define STRESS_PACKET_SIZE 20000
+
+// Clip written by the first flush, it is decoded again with a different number of the decoder threads.
+#define DECODE_BENCHMARK_INPUT "c:\\temp\\test-buff-1.mp4"
+
 StreamReader* desktopReader = NULL;
 StreamWriter* bufferWriter = NULL;
 
 int videoFrameCounter = 0;
 
+ContinuousBufferFlush* firstFlush = NULL;
+ContinuousBufferFlush* secondFlush = NULL;
+
+void flush_finished(int result, const char* output, void* opaque)
+{
+    printf("Buffer flushed to %s with result %d\n", output, result);
+}
+
+volatile LONG stressStop = 0;
+
+DWORD WINAPI take_snapshots(LPVOID arg)
+{
+    ContinuousBuffer* buffer = arg;
+    while (!InterlockedCompareExchange(&stressStop, 0, 0))
+    {
+        ContinuousBuffer* snapshot = cb_snapshot(buffer);
+        cb_free_snapshot(&snapshot);
+    }
+
+    return 0;
+}
+
+/**
+ * Push the synthetic video packets (a key frame every second) from this thread while the readers
+ * snapshot the buffer, then print the push latency of the buffer.
+ */
+void run_snapshot_stress(int nb_readers)
+{
+    StreamWriter* writer = sw_allocate_writer_from_format(NULL, &continuous_buffer_muxer);
+
+    AVRational time_base = { 1, FPS };
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = AV_CODEC_ID_H264;
+    par->width = 1920;
+    par->height = 1080;
+    sw_allocate_stream_from_parameters(writer, par, time_base);
+    avcodec_parameters_free(&par);
+
+    AVDictionary* cb_opt = cb_options(5000);
+    sw_open_writer(writer, &cb_opt);
+    ContinuousBuffer* buffer = writer->output_context->priv_data;
+
+    HANDLE readers[STRESS_READERS];
+    nb_readers = FFMIN(nb_readers, STRESS_READERS);
+    stressStop = 0;
+    for (int i = 0; i < nb_readers; i++)
+    {
+        readers[i] = CreateThread(NULL, 0, take_snapshots, buffer, 0, NULL);
+    }
+
+    AVPacket* pkt = av_packet_alloc();
+    av_new_packet(pkt, STRESS_PACKET_SIZE);
+    memset(pkt->data, 0, STRESS_PACKET_SIZE);
+    for (int i = 0; i < STRESS_PACKETS; i++)
+    {
+        pkt->pts = i;
+        pkt->dts = i;
+        pkt->duration = 1;
+        pkt->flags = i % FPS == 0 ? AV_PKT_FLAG_KEY : 0;
+        sw_write_packet(writer, AVMEDIA_TYPE_VIDEO, pkt, time_base);
+    }
+    av_packet_free(&pkt);
+
+    InterlockedExchange(&stressStop, 1);
+    for (int i = 0; i < nb_readers; i++)
+    {
+        WaitForSingleObject(readers[i], INFINITE);
+        CloseHandle(readers[i]);
+    }
+
+    StageStatsSummary summary;
+    if (cb_get_stage_stats(buffer, CB_STAGE_WRITE_PACKET, &summary) == 0)
+    {
+        printf("Push latency with %d snapshot readers: p50 %.0f us, p99 %.0f us, max %.0f us\n",
+            nb_readers, summary.p50, summary.p99, summary.max);
+    }
+
+    sw_close_writer(writer);
+    sw_free_writer(&writer);
+}
+
+int decodedFrames = 0;
+
+int count_decoded_frame(AVFrame* frame, enum AVMediaType type, int64_t pts_time)
+{
+    if (type == AVMEDIA_TYPE_VIDEO)
+    {
+        decodedFrames++;
+    }
+
+    return 0;
+}
+
+/**
+ * Decode the whole input with 1, 2, 4 and the automatic number of the decoder threads and print the decoding rate.
+ */
+void run_decode_benchmark(const char* input)
+{
+    const char* threads[] = { "1", "2", "4", "auto" };
+    for (int i = 0; i < FF_ARRAY_ELEMS(threads); i++)
+    {
+        AVDictionary* decoder_opt = NULL;
+        av_dict_set(&decoder_opt, "threads", threads[i], 0);
+        StreamReader* reader = sr_open_stream(input, NULL, decoder_opt);
+        av_dict_free(&decoder_opt);
+        if (reader == NULL)
+        {
+            fprintf(stderr, "Could not open '%s' for the decoding benchmark\n", input);
+            return;
+        }
+
+        decodedFrames = 0;
+        int64_t begin = ss_now();
+        sr_read_stream(reader, count_decoded_frame);
+        double time_spent = ss_to_seconds(ss_now() - begin);
+
+        printf("Decoding with %s threads: %d frames, %f frames/sec\n",
+            threads[i], decodedFrames, time_spent > 0 ? decodedFrames / time_spent : 0);
+
+        sr_free_reader(&reader);
+    }
+}
+
 int read_video_frame(AVFrame* frame, enum AVMediaType type, int64_t pts_time)
 {
     if (sw_write_frames(bufferWriter, type, frame, 1) < 0)
@@ -31,14 +163,14 @@ int read_video_frame(AVFrame* frame, enum AVMediaType type, int64_t pts_time)
 
     if (videoFrameCounter == 10 * FPS)
     {
-        // Finish file reading and exit the program
-        cb_write_to_mp4(bufferWriter->output_context->priv_data, "c:\\temp\\test-buff-1.mp4");
+        // Clip is written in background, capture continues meanwhile
+        firstFlush = cb_write_to_mp4_async(bufferWriter->output_context->priv_data, "c:\\temp\\test-buff-1.mp4", flush_finished, NULL);
     }
 
     if (videoFrameCounter == 15 * FPS)
     {
         // Finish file reading and exit the program
-        cb_write_to_mp4(bufferWriter->output_context->priv_data, "c:\\temp\\test-buff-2.mp4");
+        secondFlush = cb_write_to_mp4_async(bufferWriter->output_context->priv_data, "c:\\temp\\test-buff-2.mp4", flush_finished, NULL);
         return -1;
     }
 
@@ -50,9 +182,12 @@ int main()
     avdevice_register_all();
     get_devices_list("dshow");
 
+    run_snapshot_stress(0);
+    run_snapshot_stress(STRESS_READERS);
+
     AVDictionary* gdigrab_opt = NULL;
     av_dict_set(&gdigrab_opt, "framerate", "30", 0);
-    desktopReader = sr_open_input("desktop", "gdigrab", &gdigrab_opt);
+    desktopReader = sr_open_input("desktop", "gdigrab", &gdigrab_opt, NULL);
 
     bufferWriter = sw_allocate_writer_from_format(NULL, &continuous_buffer_muxer);
 
@@ -66,21 +201,44 @@ int main()
         6400000,
         desktopReader->video_decoder->width,
         desktopReader->video_decoder->height,
-        AV_PIX_FMT_YUV420P);
+        AV_PIX_FMT_YUV420P,
+        ENCODER_PROFILE_LOW_LATENCY,
+        NULL);
 
     AVDictionary* cb_opt = cb_options(5000);
     sw_open_writer(bufferWriter, &cb_opt);
 
-    clock_t begin = clock();
+    int64_t begin = ss_now();
 
     sr_read_stream(desktopReader, read_video_frame);
 
-    clock_t end = clock();
-    double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-    printf("Reading time %f\n", time_spent);
+    double time_spent = ss_to_seconds(ss_now() - begin);
+
+    ContinuousBuffer* buffer = bufferWriter->output_context->priv_data;
+    if (buffer->video != NULL && time_spent > 0)
+    {
+        printf("Video payload retained %f bytes/sec, copied %f bytes/sec\n",
+            buffer->video->bytes_retained / time_spent,
+            buffer->video->bytes_copied / time_spent);
+    }
+
+    if (buffer->pool != NULL)
+    {
+        printf("Payload pool allocations %"PRId64"\n", pp_get_nb_allocations(buffer->pool));
+    }
 
     printf("Test time\n");
+    cb_free_flush(&firstFlush);
+    cb_free_flush(&secondFlush);
+
+    // Flushes are finished, so their latency is included.
+    sr_print_stats(desktopReader);
+    sw_print_stats(bufferWriter);
+    cb_print_stats(buffer);
+
     sw_close_writer(bufferWriter);
     sr_free_reader(&desktopReader);
     sw_free_writer(&bufferWriter);
+
+    run_decode_benchmark(DECODE_BENCHMARK_INPUT);
 }
@@ -1,348 +1,2415 @@
 #include "continuous-buffer.h"
 
-int cb_pop_all_packets_internal(AVFifoBuffer* queue, AVPacket** packets)
+static int cb_get_nb_packets(ContinuousBufferStream* stream)
 {
-    if (av_fifo_size(queue) == 0)
+    return (int)(pr_get_tail(stream->queue) - pr_get_head(stream->queue));
+}
+
+static AVPacket* cb_peek_packet(ContinuousBufferStream* stream, int index)
+{
+    return pr_peek(stream->queue, pr_get_head(stream->queue) + index);
+}
+
+static int cb_get_nb_keyframes(ContinuousBufferStream* stream)
+{
+    return av_fifo_size(stream->keyframes) / sizeof(int64_t);
+}
+
+/**
+ * Sequence number of the key frame from the key frame index.
+ */
+static int64_t cb_peek_keyframe(ContinuousBufferStream* stream, int index)
+{
+    int64_t seq = -1;
+    av_fifo_generic_peek_at(stream->keyframes, &seq, index * sizeof(int64_t), sizeof(int64_t), NULL);
+
+    return seq;
+}
+
+static int cb_get_nb_batches(ContinuousBufferStream* stream)
+{
+    return av_fifo_size(stream->spill_batches) / sizeof(int64_t);
+}
+
+/**
+ * Spill queue sequence number of the first packet of the spilled batch.
+ */
+static int64_t cb_peek_batch(ContinuousBufferStream* stream, int index)
+{
+    int64_t seq = -1;
+    av_fifo_generic_peek_at(stream->spill_batches, &seq, index * sizeof(int64_t), sizeof(int64_t), NULL);
+
+    return seq;
+}
+
+/**
+ * Duration in milliseconds from the first packet until the end of the last one. It is taken from the packet
+ * timestamps, because not every encoder sets the packet duration.
+ */
+static int64_t cb_get_duration_between(ContinuousBufferStream* stream, AVPacket* first, AVPacket* last)
+{
+    return av_rescale_q(last->dts - first->dts + last->duration, stream->time_base, (AVRational){ 1, 1000 });
+}
+
+/**
+ * Evict the oldest spilled batch.
+ * @return 1 if the batch was evicted, 0 if nothing is spilled.
+ */
+static int cb_evict_spilled_batch(ContinuousBufferStream* stream)
+{
+    if (cb_get_nb_batches(stream) == 0)
     {
         return 0;
     }
 
-    int nb_pkt = av_fifo_size(queue) / sizeof(AVPacket);
+    av_fifo_drain(stream->spill_batches, sizeof(int64_t));
 
-    *packets = av_mallocz(sizeof(AVPacket) * nb_pkt);
-    av_fifo_generic_read(queue, *packets, av_fifo_size(queue), NULL);
+    int64_t next = cb_get_nb_batches(stream) > 0 ? cb_peek_batch(stream, 0) : pr_get_tail(stream->spill_queue);
+    pr_advance_head(stream->spill_queue, next);
 
-    return nb_pkt;
+    return 1;
 }
 
-int cb_pop_all_packets_from_stream(ContinuousBufferStream* stream, AVPacket** packets)
+/**
+ * Evict the oldest spilled batches while the rest of both tiers still covers the duration (in ms).
+ */
+static void cb_trim_spill(ContinuousBufferStream* stream, int64_t duration)
 {
-    int result = cb_pop_all_packets_internal(stream->queue, packets);
-    stream->duration = 0;
-    return result;
+    if (cb_get_nb_packets(stream) == 0)
+    {
+        return;
+    }
+
+    AVPacket* last = cb_peek_packet(stream, cb_get_nb_packets(stream) - 1);
+
+    while (cb_get_nb_batches(stream) > 0)
+    {
+        // Once the oldest batch is gone, the remainder starts from the next batch or from the memory tier.
+        AVPacket* next = cb_get_nb_batches(stream) > 1
+            ? pr_peek(stream->spill_queue, cb_peek_batch(stream, 1))
+            : cb_peek_packet(stream, 0);
+
+        if (cb_get_duration_between(stream, next, last) < duration)
+        {
+            break;
+        }
+
+        cb_evict_spilled_batch(stream);
+    }
 }
 
-int cb_pop_all_packets(ContinuousBuffer* buffer, enum AVMediaType type, AVPacket** packets)
+/**
+ * Copy the queued packets before the sequence number to a single extent of the spill file and move them
+ * to the spill queue. The first packet of the queue and the packet at the sequence number must be key frames.
+ * If there is no space even after the older batches are evicted, the spill tier is dropped along with
+ * the packets, so the spilled packets never have a gap before the memory tier.
+ */
+static void cb_spill_packets(ContinuousBufferStream* stream, int64_t seq)
 {
-    if (type == AVMEDIA_TYPE_VIDEO && buffer->video != NULL)
+    int64_t head = pr_get_head(stream->queue);
+    if (seq <= head)
     {
-        return cb_pop_all_packets_from_stream(buffer->video, packets);
+        return;
     }
-    else if (type == AVMEDIA_TYPE_AUDIO && buffer->audio != NULL)
+
+    int64_t size = 0;
+    for (int64_t i = head; i < seq; i++)
     {
-        return cb_pop_all_packets_from_stream(buffer->audio, packets);
+        size += pr_peek(stream->queue, i)->size + AV_INPUT_BUFFER_PADDING_SIZE;
     }
 
-    return -1;
-}
+    AVBufferRef* extent = NULL;
+    while (pr_get_free_slots(stream->spill_queue) < seq - head || (extent = sf_alloc_extent(stream->spill, size)) == NULL)
+    {
+        if (!cb_evict_spilled_batch(stream))
+        {
+            break;
+        }
+    }
 
-int cb_write_stream_to_stream(ContinuousBufferStream* stream, AVFormatContext* fmt_ctx, AVCodecContext* c, AVStream* st)
-{
-    AVPacket* packets = NULL;
-    int nb_packets = cb_pop_all_packets_from_stream(stream, &packets);    
+    if (extent != NULL && av_fifo_space(stream->spill_batches) < sizeof(int64_t)
+        && av_fifo_grow(stream->spill_batches, FFMAX(av_fifo_size(stream->spill_batches), (int)sizeof(int64_t))) < 0)
+    {
+        av_buffer_unref(&extent);
+    }
 
-    AVPacket* ppackets = packets;
+    if (extent == NULL)
+    {
+        pr_advance_head(stream->spill_queue, pr_get_tail(stream->spill_queue));
+        av_fifo_reset(stream->spill_batches);
+        return;
+    }
 
-    int keyFrame = 0;
-    for (int i = 0; i < nb_packets; i++) {
-        packets->pts = i;
-        packets->dts = i;
+    int64_t batch = pr_get_tail(stream->spill_queue);
+    av_fifo_generic_write(stream->spill_batches, &batch, sizeof(int64_t), NULL);
 
-        if (packets->flags & AV_PKT_FLAG_KEY)
+    // Payloads are written one after another, so the file gets a single large sequential write.
+    uint8_t* data = extent->data;
+    int64_t keyframe = batch;
+    for (int64_t i = head; i < seq; i++)
+    {
+        AVPacket* src = pr_peek(stream->queue, i);
+        AVPacket* pkt = stream->spill_packet;
+
+        if (av_packet_copy_props(pkt, src) < 0 || (pkt->buf = av_buffer_ref(extent)) == NULL)
         {
-            keyFrame = 1;
+            av_packet_unref(pkt);
+            break;
         }
 
-        // Video should start from the key frame. If there is no key frame yet, then packet must be skipped.
-        if (keyFrame == 1)
+        pkt->data = data;
+        pkt->size = src->size;
+        memcpy(data, src->data, src->size);
+        memset(data + src->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        data += src->size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+        if (pr_peek_keyframe(stream->queue, i) == i)
         {
-            write_packet(fmt_ctx, c, st, packets);
+            keyframe = pr_get_tail(stream->spill_queue);
         }
 
-        av_packet_unref(packets);
-        av_packet_free_side_data(packets);
-        packets++;
+        stream->bytes_spilled += src->size;
+        pr_push(stream->spill_queue, pkt, keyframe);
+    }
+
+    av_buffer_unref(&extent);
+}
+
+/**
+ * Remove the queued packets before the sequence number. The ring frees them once no reader could see them.
+ * If the spill is enabled, the packets are moved to the spill tier instead.
+ */
+static void cb_evict_packets(ContinuousBufferStream* stream, int64_t seq)
+{
+    if (stream->spill_queue != NULL)
+    {
+        cb_spill_packets(stream, seq);
     }
 
-    if (ppackets != NULL)
+    for (int64_t i = pr_get_head(stream->queue); i < seq; i++)
     {
-        av_freep(&ppackets);
+        AVPacket* pkt = pr_peek(stream->queue, i);
+        stream->duration -= pkt->duration;
+        stream->size -= pkt->size;
     }
 
-    return 0;
+    while (cb_get_nb_keyframes(stream) > 0 && cb_peek_keyframe(stream, 0) < seq)
+    {
+        av_fifo_drain(stream->keyframes, sizeof(int64_t));
+    }
+
+    pr_advance_head(stream->queue, seq);
 }
 
-int cb_write_to_mp4(ContinuousBuffer* buffer, const char* output)
+/**
+ * Append the packet to the queue, the queue takes over the packet reference.
+ * @return 0 on success, AVERROR(EAGAIN) if the ring is full.
+ */
+static int cb_append_packet(ContinuousBufferStream* stream, AVPacket* pkt)
 {
-    AVFormatContext* outputFormat;
+    if (pr_is_full(stream->queue))
+    {
+        return AVERROR(EAGAIN);
+    }
 
-    /* allocate the output media context */
-    avformat_alloc_output_context2(&outputFormat, NULL, "mp4", output);
-    if (!outputFormat)
+    int64_t seq = pr_get_tail(stream->queue);
+    if (pkt->flags & AV_PKT_FLAG_KEY)
     {
-        fprintf(stderr, "Output format was not initialized.\n");
-        return -1;
+        if (av_fifo_space(stream->keyframes) < sizeof(int64_t)
+            && av_fifo_grow(stream->keyframes, FFMAX(av_fifo_size(stream->keyframes), (int)sizeof(int64_t))) < 0)
+        {
+            return AVERROR(ENOMEM);
+        }
+
+        av_fifo_generic_write(stream->keyframes, &seq, sizeof(int64_t), NULL);
+    }
+
+    // Queue always starts from a key frame, so the index is never empty here.
+    int64_t keyframe = cb_peek_keyframe(stream, cb_get_nb_keyframes(stream) - 1);
+
+    stream->duration += pkt->duration;
+    stream->size += pkt->size;
+
+    return pr_push(stream->queue, pkt, keyframe);
+}
+
+/**
+ * Duration in milliseconds from the specified packet to the end of the queue.
+ */
+static int64_t cb_get_duration_from(ContinuousBufferStream* stream, int index)
+{
+    int nb_packets = cb_get_nb_packets(stream);
+    if (index >= nb_packets)
+    {
+        return 0;
     }
 
-    AVCodecContext* video = NULL;
+    return cb_get_duration_between(stream, cb_peek_packet(stream, index), cb_peek_packet(stream, nb_packets - 1));
+}
+
+static int64_t cb_get_size(ContinuousBuffer* buffer)
+{
+    int64_t size = 0;
+
     if (buffer->video != NULL)
     {
-        video = allocate_video_stream(outputFormat, buffer->video->codec, buffer->video->time_base, buffer->video->bit_rate, buffer->video->width, buffer->video->height, buffer->video->pixel_format);
+        size += buffer->video->size;
     }
 
-    AVCodecContext* audio = NULL;
     if (buffer->audio != NULL)
     {
-        audio = allocate_audio_stream(outputFormat, buffer->audio->codec, buffer->audio->bit_rate, buffer->audio->sample_rate, buffer->audio->channel_layout, buffer->audio->sample_fmt);
+        size += buffer->audio->size;
     }
 
-    av_dump_format(outputFormat, 0, output, 1);
+    return size;
+}
 
-    int ret = 0;
-    /* open the output file, if needed */
-    if (!(outputFormat->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&(outputFormat->pb), output, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open '%s': %s\n", output,
-                av_err2str(ret));
-            return -1;
-        }
+/**
+ * Find the key frame which starts the second GOP of the queue.
+ * @return Index of the key frame or -1 if the queue holds a single (probably incomplete) GOP.
+ */
+static int cb_find_next_gop(ContinuousBufferStream* stream)
+{
+    if (cb_get_nb_keyframes(stream) < 2)
+    {
+        return -1;
     }
 
-    /* Write the stream header, if any. */
-    ret = avformat_write_header(outputFormat, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error occurred when opening output file: %s\n",
-            av_err2str(ret));
-        return -1;
+    return (int)(cb_peek_keyframe(stream, 1) - pr_get_head(stream->queue));
+}
+
+/**
+ * Remove the oldest GOP from the queue. The latest GOP is never removed.
+ * @return 1 if GOP was removed, 0 otherwise.
+ */
+static int cb_evict_gop(ContinuousBufferStream* stream)
+{
+    int next_gop = cb_find_next_gop(stream);
+    if (next_gop < 0)
+    {
+        return 0;
     }
 
-    int audio_idx = -1;
-    int video_idx = -1;
+    cb_evict_packets(stream, pr_get_head(stream->queue) + next_gop);
+
+    return 1;
+}
+
+/**
+ * Remove the oldest GOP among the buffer streams, so the streams stay aligned in time.
+ * @return 1 if GOP was removed, 0 otherwise.
+ */
+static int cb_evict_oldest_gop(ContinuousBuffer* buffer)
+{
+    ContinuousBufferStream* streams[] = { buffer->video, buffer->audio };
 
-    for (int i = 0; i < outputFormat->nb_streams; i++)
+    ContinuousBufferStream* oldest = NULL;
+    int64_t oldest_time = INT64_MAX;
+    for (int i = 0; i < FF_ARRAY_ELEMS(streams); i++)
     {
-        if (outputFormat->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) 
+        if (streams[i] == NULL || cb_find_next_gop(streams[i]) < 0)
         {
-            audio_idx = i;
+            continue;
         }
 
-        if (outputFormat->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        int64_t head_time = av_rescale_q(cb_peek_packet(streams[i], 0)->dts, streams[i]->time_base, AV_TIME_BASE_Q);
+        if (head_time < oldest_time)
         {
-            video_idx = i;
+            oldest = streams[i];
+            oldest_time = head_time;
         }
     }
 
-    if (buffer->video != NULL)
+    if (oldest == NULL)
     {
-        cb_write_stream_to_stream(buffer->video, outputFormat, video, outputFormat->streams[video_idx]);
+        return 0;
     }
 
-    if (buffer->audio != NULL)
+    return cb_evict_gop(oldest);
+}
+
+/**
+ * Remove the oldest GOPs while the rest of the queue still covers the specified duration (in ms).
+ * All such GOPs are removed at once, so they make a single spilled batch.
+ */
+static void cb_evict_to_duration(ContinuousBufferStream* stream, int64_t duration)
+{
+    int64_t head = pr_get_head(stream->queue);
+    int64_t seq = -1;
+
+    for (int i = 1; i < cb_get_nb_keyframes(stream); i++)
     {
-        cb_write_stream_to_stream(buffer->audio, outputFormat, audio, outputFormat->streams[audio_idx]);
+        int64_t keyframe = cb_peek_keyframe(stream, i);
+        if (cb_get_duration_from(stream, (int)(keyframe - head)) < duration)
+        {
+            break;
+        }
+
+        seq = keyframe;
     }
 
-    if (video != NULL && video_idx >= 0)
+    if (seq > head)
     {
-        AVPacket* pkt = av_packet_alloc();
-        write_frame(outputFormat, video, outputFormat->streams[video_idx], NULL, pkt);
-        av_packet_free(&pkt);
+        cb_evict_packets(stream, seq);
     }
+}
 
-    if (audio != NULL && audio_idx >= 0)
+/**
+ * Find the first spilled packet in [first, last) which is not older than the decoding timestamp.
+ */
+static int64_t cb_find_spilled_from(ContinuousBufferStream* stream, int64_t first, int64_t last, int64_t dts)
+{
+    while (first < last)
     {
-        AVPacket* pkt = av_packet_alloc();
-        write_frame(outputFormat, audio, outputFormat->streams[audio_idx], NULL, pkt);
-        av_packet_free(&pkt);
+        int64_t middle = first + (last - first) / 2;
+        if (pr_peek(stream->spill_queue, middle)->dts < dts)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            last = middle;
+        }
     }
 
-    av_write_trailer(outputFormat);
+    return first;
+}
 
-    if (audio != NULL)
+/**
+ * Pin both tiers of the stream. Packets of the view are addressed by the index, the spilled packets go first.
+ */
+static int cb_acquire_view(ContinuousBufferStream* stream, ContinuousBufferView* view)
+{
+    memset(view, 0, sizeof(ContinuousBufferView));
+    view->rings[0] = stream->spill_queue;
+    view->rings[1] = stream->queue;
+    view->pins[0] = -1;
+
+    // Memory tier is pinned first: the packets evicted from the memory before are already in the spill queue.
+    view->pins[1] = pr_acquire(stream->queue, &view->first[1]);
+    if (view->pins[1] < 0)
     {
-        avcodec_free_context(&audio);
+        fprintf(stderr, "Too many concurrent readers of the buffer.\n");
+        return AVERROR(EBUSY);
     }
+    view->last[1] = pr_get_tail(stream->queue);
 
-    if (video != NULL)
+    if (stream->spill_queue != NULL)
     {
-        avcodec_free_context(&video);
+        view->pins[0] = pr_acquire(stream->spill_queue, &view->first[0]);
+        if (view->pins[0] < 0)
+        {
+            fprintf(stderr, "Too many concurrent readers of the buffer.\n");
+            pr_release(stream->queue, view->pins[1]);
+            return AVERROR(EBUSY);
+        }
+        view->last[0] = pr_get_tail(stream->spill_queue);
+
+        // Packets spilled after the memory tier was pinned are visible in both tiers, they are taken from the memory.
+        if (view->last[1] > view->first[1])
+        {
+            view->last[0] = cb_find_spilled_from(stream, view->first[0], view->last[0], pr_peek(stream->queue, view->first[1])->dts);
+        }
     }
 
-    if (!(outputFormat->oformat->flags & AVFMT_NOFILE))
+    return 0;
+}
+
+static void cb_release_view(ContinuousBufferView* view)
+{
+    if (view->rings[0] != NULL)
     {
-        /* Close the output file. */
-        avio_closep(&outputFormat->pb);
+        pr_release(view->rings[0], view->pins[0]);
     }
 
-    /* free the stream */
-    avformat_free_context(outputFormat);
-
-    return ret;
+    pr_release(view->rings[1], view->pins[1]);
 }
 
-AVDictionary* cb_options(int64_t duration)
+static int64_t cb_get_view_nb_packets(ContinuousBufferView* view)
 {
-    AVDictionary* opt = NULL;
-    av_dict_set_int(&opt, "duration", duration, 0);
-
-    return opt;
+    return view->last[0] - view->first[0] + view->last[1] - view->first[1];
 }
 
-static int cb_is_empty(ContinuousBuffer* buffer) 
+static AVPacket* cb_peek_view_packet(ContinuousBufferView* view, int64_t index)
 {
-    if (buffer->audio != NULL && av_fifo_size(buffer->audio->queue) > 0)
+    int64_t nb_spilled = view->last[0] - view->first[0];
+    if (index < nb_spilled)
     {
-        return 0;
+        return pr_peek(view->rings[0], view->first[0] + index);
     }
 
-    if (buffer->video != NULL && av_fifo_size(buffer->video->queue) > 0)
+    return pr_peek(view->rings[1], view->first[1] + index - nb_spilled);
+}
+
+/**
+ * View index of the key frame which starts the GOP of the packet.
+ */
+static int64_t cb_peek_view_keyframe(ContinuousBufferView* view, int64_t index)
+{
+    int64_t nb_spilled = view->last[0] - view->first[0];
+    if (index < nb_spilled)
     {
-        return 0;
+        return pr_peek_keyframe(view->rings[0], view->first[0] + index) - view->first[0];
     }
 
-    return 1;
+    return nb_spilled + pr_peek_keyframe(view->rings[1], view->first[1] + index - nb_spilled) - view->first[1];
 }
 
-static int cb_init(AVFormatContext* avf)
+/**
+ * Decoding time of the packet in milliseconds.
+ */
+static int64_t cb_get_packet_time(ContinuousBufferStream* stream, ContinuousBufferView* view, int64_t index)
 {
-    ContinuousBuffer* buffer = avf->priv_data;
-    for (int i = 0; i < avf->nb_streams; i++)
+    return av_rescale_q(cb_peek_view_packet(view, index)->dts, stream->time_base, (AVRational){ 1, 1000 });
+}
+
+/**
+ * Binary search over the packets of the view.
+ * @return Index of the key frame which starts the GOP of the last packet at or before the time (ms),
+ * or 0 if all the packets are later.
+ */
+static int64_t cb_find_keyframe_before(ContinuousBufferStream* stream, ContinuousBufferView* view, int64_t time)
+{
+    int64_t found = 0;
+    int64_t low = 0;
+    int64_t high = cb_get_view_nb_packets(view) - 1;
+
+    while (low <= high)
     {
-        if (avf->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        int64_t middle = low + (high - low) / 2;
+        if (cb_get_packet_time(stream, view, middle) <= time)
         {
-            ContinuousBufferStream* buffer_stream = av_mallocz(sizeof(ContinuousBufferStream));
-            buffer_stream->type = AVMEDIA_TYPE_VIDEO;
-            buffer_stream->codec = avf->streams[i]->codecpar->codec_id;
-            buffer_stream->width = avf->streams[i]->codecpar->width;
-            buffer_stream->height = avf->streams[i]->codecpar->height;
-            buffer_stream->pixel_format = avf->streams[i]->codecpar->format;
-            buffer_stream->time_base = avf->streams[i]->time_base;
-            buffer_stream->bit_rate = avf->streams[i]->codecpar->bit_rate;
-            buffer_stream->duration = 0;
-
-            buffer_stream->queue = av_fifo_alloc_array((size_t)avf->streams[i]->time_base.den * buffer->duration / 1000, sizeof(AVPacket));
-            buffer->video = buffer_stream;
+            found = middle;
+            low = middle + 1;
         }
-        else if (avf->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        else
         {
-            ContinuousBufferStream* buffer_stream = av_mallocz(sizeof(ContinuousBufferStream));
-            buffer_stream->type = AVMEDIA_TYPE_AUDIO;
-            buffer_stream->codec = avf->streams[i]->codecpar->codec_id;
-            buffer_stream->sample_rate = avf->streams[i]->codecpar->sample_rate;
-            buffer_stream->bit_rate = avf->streams[i]->codecpar->bit_rate;
-            buffer_stream->channel_layout = avf->streams[i]->codecpar->channel_layout;
-            buffer_stream->time_base = avf->streams[i]->time_base;
-            buffer_stream->sample_fmt = avf->streams[i]->codecpar->format;
-            buffer_stream->frame_size = avf->streams[i]->codecpar->frame_size;
-            buffer_stream->duration = 0;
-
-            size_t queue_length = (size_t)avf->streams[i]->codecpar->sample_rate * buffer->duration / (((size_t)avf->streams[i]->codecpar->frame_size) * 1000);
-            buffer_stream->queue = av_fifo_alloc_array(queue_length, sizeof(AVPacket));
-
-            buffer->audio = buffer_stream;
+            high = middle - 1;
         }
     }
 
-    return 0;
+    return cb_peek_view_keyframe(view, found);
 }
 
-static int cb_write_packet(AVFormatContext* avf, AVPacket* pkt)
+/**
+ * Binary search over the packets of the view.
+ * @return Index of the first packet after the time (ms), or the number of the packets if there is no such packet.
+ */
+static int64_t cb_find_packet_after(ContinuousBufferStream* stream, ContinuousBufferView* view, int64_t time)
 {
-    if (pkt == NULL)
+    int64_t low = 0;
+    int64_t high = cb_get_view_nb_packets(view);
+
+    while (low < high)
     {
-        return 0;
+        int64_t middle = low + (high - low) / 2;
+        if (cb_get_packet_time(stream, view, middle) <= time)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
     }
 
-    ContinuousBuffer* buffer = avf->priv_data;
-
-    AVPacket* clone = av_packet_alloc();
-    av_packet_copy_props(clone, pkt);
-    av_new_packet(clone, pkt->size);
-    
-    if (pkt->size)
-        memcpy(clone->buf->data, pkt->data, pkt->size);
-
-    clone->data = clone->buf->data;
-    clone->flags = pkt->flags;
+    return low;
+}
 
-    clone->duration = pkt->duration;
-    clone->dts = pkt->dts;
-    clone->pts = pkt->pts;
+static void cb_free_packets(AVPacket*** packets, int nb_packets)
+{
+    for (int i = 0; i < nb_packets; i++)
+    {
+        av_packet_free(&(*packets)[i]);
+    }
 
-    int s_idx = pkt->stream_index;
+    av_freep(packets);
+}
 
-    ContinuousBufferStream* buffer_stream = NULL;
-    int media_type = avf->streams[s_idx]->codecpar->codec_type;
-    if (media_type == AVMEDIA_TYPE_VIDEO)
+/**
+ * Clone the first nb_pkt packets of the pinned view.
+ */
+static int cb_clone_view_packets(ContinuousBufferView* view, int64_t nb_pkt, AVPacket*** packets)
+{
+    if (nb_pkt == 0)
     {
-        buffer_stream = buffer->video;
+        return 0;
     }
-    else if (media_type == AVMEDIA_TYPE_AUDIO)
+
+    *packets = av_mallocz(sizeof(AVPacket*) * nb_pkt);
+    if (*packets == NULL)
     {
-        buffer_stream = buffer->audio;
+        return AVERROR(ENOMEM);
     }
 
-    // Taking current amount the free space in the queue.
-    int space = av_fifo_space(buffer_stream->queue);
-
-    // Taking current amount of queue which was already used.
-    int size = av_fifo_size(buffer_stream->queue);
-
-    while (av_fifo_space(buffer_stream->queue) <= 0 || buffer_stream->duration >= buffer->duration)
+    // Packets are new references to the same payload, the queues are not modified.
+    for (int i = 0; i < nb_pkt; i++)
     {
-        AVPacket* removePkt = av_mallocz(sizeof(AVPacket));
-        av_fifo_generic_read(buffer_stream->queue, removePkt, sizeof(AVPacket), NULL);
+        (*packets)[i] = av_packet_clone(cb_peek_view_packet(view, i));
+        if ((*packets)[i] == NULL)
+        {
+            cb_free_packets(packets, i);
+            return AVERROR(ENOMEM);
+        }
+    }
 
-        buffer_stream->duration -= removePkt->duration;
+    return (int)nb_pkt;
+}
 
-        av_packet_free(&removePkt);
+int cb_pop_all_packets_internal(PacketRing* queue, AVPacket*** packets)
+{
+    // Only the producer could evict the packets, so the reader pins the ring and leaves the head where it is.
+    ContinuousBufferView view;
+    memset(&view, 0, sizeof(ContinuousBufferView));
+    view.rings[1] = queue;
+    view.pins[0] = -1;
+    view.pins[1] = pr_acquire(queue, &view.first[1]);
+    if (view.pins[1] < 0)
+    {
+        fprintf(stderr, "Too many concurrent readers of the buffer.\n");
+        return AVERROR(EBUSY);
     }
+    view.last[1] = pr_get_tail(queue);
 
-    buffer_stream->duration += clone->duration;
-    av_fifo_generic_write(buffer->video->queue, clone, sizeof(AVPacket), NULL);
+    int ret = cb_clone_view_packets(&view, cb_get_view_nb_packets(&view), packets);
 
-    return 1;
+    cb_release_view(&view);
+
+    return ret;
 }
 
-static void cb_deinit_stream(ContinuousBufferStream* stream)
+int cb_pop_all_packets_from_stream(ContinuousBufferStream* stream, AVPacket*** packets)
 {
-    AVPacket* packets = NULL;
-    int nb_packets = cb_pop_all_packets_from_stream(stream, &packets);
+    // View takes the spilled packets first, they are older than the packets in memory.
+    ContinuousBufferView view;
+    int ret = cb_acquire_view(stream, &view);
+    if (ret < 0)
+    {
+        return ret;
+    }
 
-    AVPacket* ppackets = packets;
+    ret = cb_clone_view_packets(&view, cb_get_view_nb_packets(&view), packets);
 
-    for (int i = 0; i < nb_packets; i++) {
-        av_packet_unref(packets);
-        av_packet_free_side_data(packets);
-        packets++;
+    cb_release_view(&view);
+
+    return ret;
+}
+
+int cb_pop_all_packets(ContinuousBuffer* buffer, enum AVMediaType type, AVPacket*** packets)
+{
+    if (type == AVMEDIA_TYPE_VIDEO && buffer->video != NULL)
+    {
+        return cb_pop_all_packets_from_stream(buffer->video, packets);
     }
-    
-    if (ppackets != NULL)
+    else if (type == AVMEDIA_TYPE_AUDIO && buffer->audio != NULL)
     {
-        av_freep(&ppackets);
+        return cb_pop_all_packets_from_stream(buffer->audio, packets);
     }
 
-    av_fifo_free(stream->queue);
-    stream->queue = NULL;
+    return -1;
+}
+
+static void cb_deinit_stream(ContinuousBufferStream* stream)
+{
+    pr_free(&stream->queue);
+    av_fifo_freep(&stream->keyframes);
+    av_packet_free(&stream->packet);
+
+    pr_free(&stream->spill_queue);
+    av_fifo_freep(&stream->spill_batches);
+    av_packet_free(&stream->spill_packet);
+
+    avcodec_parameters_free(&stream->codecpar);
 
-    av_freep(stream);
+    av_freep(&stream);
 }
 
-static void cb_deinit(AVFormatContext* avf)
+/**
+ * Take a snapshot of the view slice [first, last). First packet of the slice must be a key frame.
+ */
+static ContinuousBufferStream* cb_snapshot_stream_range(ContinuousBufferStream* stream, ContinuousBufferView* view, int64_t first, int64_t last)
 {
-    ContinuousBuffer* b = avf->priv_data;    
+    ContinuousBufferStream* snapshot = av_mallocz(sizeof(ContinuousBufferStream));
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
 
-    if (b->audio != NULL)
+    *snapshot = *stream;
+    snapshot->queue = NULL;
+    snapshot->keyframes = NULL;
+    snapshot->packet = NULL;
+    snapshot->spill = NULL;
+    snapshot->spill_queue = NULL;
+    snapshot->spill_batches = NULL;
+    snapshot->spill_packet = NULL;
+    snapshot->duration = 0;
+    snapshot->size = 0;
+
+    // Snapshot could outlive the buffer (e.g. background flush), so it owns a copy of the stream parameters.
+    snapshot->codecpar = avcodec_parameters_alloc();
+    if (snapshot->codecpar == NULL || avcodec_parameters_copy(snapshot->codecpar, stream->codecpar) < 0)
     {
-        cb_deinit_stream(b->audio);
-        b->audio = NULL;
+        avcodec_parameters_free(&snapshot->codecpar);
+        av_freep(&snapshot);
+        return NULL;
     }
 
-    if (b->video != NULL)
+    snapshot->queue = pr_alloc(FFMAX(last - first, 1), NULL);
+    snapshot->keyframes = av_fifo_alloc_array(CB_KEYFRAMES_INITIAL_SIZE, sizeof(int64_t));
+    snapshot->packet = av_packet_alloc();
+    if (snapshot->queue == NULL || snapshot->keyframes == NULL || snapshot->packet == NULL)
     {
-        cb_deinit_stream(b->video);
-        b->video = NULL;
+        cb_deinit_stream(snapshot);
+        return NULL;
+    }
+
+    // Walk the pinned slice without touching the live queues. Every packet is a new reference
+    // to the same payload (spilled payloads stay in the mapped file), snapshot sequence numbers start from zero.
+    for (int64_t i = first; i < last; i++)
+    {
+        if (av_packet_ref(snapshot->packet, cb_peek_view_packet(view, i)) < 0
+            || cb_append_packet(snapshot, snapshot->packet) < 0)
+        {
+            cb_deinit_stream(snapshot);
+            return NULL;
+        }
+    }
+
+    return snapshot;
+}
+
+static ContinuousBufferStream* cb_snapshot_stream(ContinuousBufferStream* stream)
+{
+    ContinuousBufferView view;
+    if (cb_acquire_view(stream, &view) < 0)
+    {
+        return NULL;
+    }
+
+    ContinuousBufferStream* snapshot = cb_snapshot_stream_range(stream, &view, 0, cb_get_view_nb_packets(&view));
+
+    cb_release_view(&view);
+
+    return snapshot;
+}
+
+ContinuousBuffer* cb_snapshot(ContinuousBuffer* buffer)
+{
+    ContinuousBuffer* snapshot = av_mallocz(sizeof(ContinuousBuffer));
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+
+    snapshot->duration = buffer->duration;
+    snapshot->window = buffer->window;
+    snapshot->zero_copy = buffer->zero_copy;
+    snapshot->stats = buffer->stats != NULL ? av_buffer_ref(buffer->stats) : NULL;
+
+    if (buffer->video != NULL)
+    {
+        snapshot->video = cb_snapshot_stream(buffer->video);
+        if (snapshot->video == NULL)
+        {
+            cb_free_snapshot(&snapshot);
+            return NULL;
+        }
+    }
+
+    if (buffer->audio != NULL)
+    {
+        snapshot->audio = cb_snapshot_stream(buffer->audio);
+        if (snapshot->audio == NULL)
+        {
+            cb_free_snapshot(&snapshot);
+            return NULL;
+        }
+    }
+
+    return snapshot;
+}
+
+void cb_free_snapshot(ContinuousBuffer** snapshot)
+{
+    ContinuousBuffer* s = *snapshot;
+    if (s == NULL)
+    {
+        return;
+    }
+
+    if (s->audio != NULL)
+    {
+        cb_deinit_stream(s->audio);
+        s->audio = NULL;
+    }
+
+    if (s->video != NULL)
+    {
+        cb_deinit_stream(s->video);
+        s->video = NULL;
+    }
+
+    pr_free(&s->fragment_queue);
+    av_packet_free(&s->fragment);
+    av_buffer_unref(&s->init_segment);
+    av_buffer_unref(&s->stats);
+
+    av_freep(snapshot);
+}
+
+/**
+ * Take a snapshot of the completed fragments, the packet queues are not copied.
+ * Falls back to the regular snapshot until the first fragment is completed.
+ */
+static ContinuousBuffer* cb_snapshot_fragments(ContinuousBuffer* buffer)
+{
+    int64_t head = 0;
+    int pin = pr_acquire(buffer->fragment_queue, &head);
+    if (pin < 0)
+    {
+        fprintf(stderr, "Too many concurrent readers of the buffer.\n");
+        return NULL;
+    }
+
+    int64_t tail = pr_get_tail(buffer->fragment_queue);
+    if (tail == head)
+    {
+        pr_release(buffer->fragment_queue, pin);
+        return cb_snapshot(buffer);
+    }
+
+    ContinuousBuffer* snapshot = av_mallocz(sizeof(ContinuousBuffer));
+    if (snapshot == NULL)
+    {
+        pr_release(buffer->fragment_queue, pin);
+        return NULL;
+    }
+
+    snapshot->duration = buffer->duration;
+    snapshot->window = buffer->window;
+    snapshot->zero_copy = buffer->zero_copy;
+    snapshot->stats = buffer->stats != NULL ? av_buffer_ref(buffer->stats) : NULL;
+    snapshot->init_segment = av_buffer_ref(buffer->init_segment);
+    snapshot->fragment_queue = pr_alloc(tail - head, NULL);
+    snapshot->fragment = av_packet_alloc();
+    if (snapshot->init_segment == NULL || snapshot->fragment_queue == NULL || snapshot->fragment == NULL)
+    {
+        pr_release(buffer->fragment_queue, pin);
+        cb_free_snapshot(&snapshot);
+        return NULL;
+    }
+
+    for (int64_t seq = head; seq < tail; seq++)
+    {
+        if (av_packet_ref(snapshot->fragment, pr_peek(buffer->fragment_queue, seq)) < 0
+            || pr_push(snapshot->fragment_queue, snapshot->fragment, seq - head) < 0)
+        {
+            pr_release(buffer->fragment_queue, pin);
+            cb_free_snapshot(&snapshot);
+            return NULL;
+        }
+    }
+
+    pr_release(buffer->fragment_queue, pin);
+
+    return snapshot;
+}
+
+/**
+ * Snapshot which is written by the flush: the fragments in the fragmented mode, otherwise the packets.
+ */
+static ContinuousBuffer* cb_snapshot_for_flush(ContinuousBuffer* buffer)
+{
+    return buffer->fragment_queue != NULL ? cb_snapshot_fragments(buffer) : cb_snapshot(buffer);
+}
+
+/**
+ * Take a snapshot of the stream packets between start and end (ms), it starts from the key frame before start.
+ * @param[in,out] start Moved to the time of the key frame which starts the snapshot.
+ * @return 1 if the snapshot was taken, 0 if the stream is empty, negative value on error.
+ */
+static int cb_snapshot_stream_between(ContinuousBufferStream* stream, int64_t* start, int64_t end, ContinuousBufferStream** snapshot)
+{
+    ContinuousBufferView view;
+    int ret = cb_acquire_view(stream, &view);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    if (cb_get_view_nb_packets(&view) == 0)
+    {
+        cb_release_view(&view);
+        return 0;
+    }
+
+    int64_t first = cb_find_keyframe_before(stream, &view, *start);
+    int64_t last = cb_find_packet_after(stream, &view, end);
+
+    *start = cb_get_packet_time(stream, &view, first);
+    *snapshot = cb_snapshot_stream_range(stream, &view, first, FFMAX(first, last));
+
+    cb_release_view(&view);
+
+    return *snapshot != NULL ? 1 : AVERROR(ENOMEM);
+}
+
+ContinuousBuffer* cb_snapshot_range(ContinuousBuffer* buffer, enum AVMediaType type, int64_t start, int64_t end)
+{
+    if (end < start)
+    {
+        return NULL;
+    }
+
+    ContinuousBufferStream* video = type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_UNKNOWN ? buffer->video : NULL;
+    ContinuousBufferStream* audio = type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_UNKNOWN ? buffer->audio : NULL;
+
+    ContinuousBuffer* snapshot = av_mallocz(sizeof(ContinuousBuffer));
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+
+    snapshot->duration = buffer->duration;
+    snapshot->window = buffer->window;
+    snapshot->zero_copy = buffer->zero_copy;
+    snapshot->stats = buffer->stats != NULL ? av_buffer_ref(buffer->stats) : NULL;
+
+    // Other streams are aligned to the key frame which starts the video slice.
+    int ret = 0;
+    if (video != NULL)
+    {
+        ret = cb_snapshot_stream_between(video, &start, end, &snapshot->video);
+    }
+
+    if (audio != NULL && ret >= 0)
+    {
+        ret = cb_snapshot_stream_between(audio, &start, end, &snapshot->audio);
+    }
+
+    if (ret < 0 || (snapshot->video == NULL && snapshot->audio == NULL))
+    {
+        cb_free_snapshot(&snapshot);
+        return NULL;
+    }
+
+    return snapshot;
+}
+
+static int64_t cb_get_stream_end_time(ContinuousBufferStream* stream)
+{
+    int64_t end_time = AV_NOPTS_VALUE;
+
+    ContinuousBufferView view;
+    if (cb_acquire_view(stream, &view) < 0)
+    {
+        return AV_NOPTS_VALUE;
+    }
+
+    if (cb_get_view_nb_packets(&view) > 0)
+    {
+        end_time = cb_get_packet_time(stream, &view, cb_get_view_nb_packets(&view) - 1);
+    }
+
+    cb_release_view(&view);
+
+    return end_time;
+}
+
+int64_t cb_get_end_time(ContinuousBuffer* buffer)
+{
+    int64_t end_time = AV_NOPTS_VALUE;
+
+    if (buffer->video != NULL)
+    {
+        end_time = cb_get_stream_end_time(buffer->video);
+    }
+
+    if (buffer->audio != NULL)
+    {
+        end_time = FFMAX(end_time, cb_get_stream_end_time(buffer->audio));
+    }
+
+    return end_time;
+}
+
+static int64_t cb_get_stream_start_time(ContinuousBufferStream* stream)
+{
+    if (cb_get_nb_packets(stream) == 0)
+    {
+        return AV_NOPTS_VALUE;
+    }
+
+    // Queue head is always a key frame.
+    return av_rescale_q(cb_peek_packet(stream, 0)->dts, stream->time_base, AV_TIME_BASE_Q);
+}
+
+static AVStream* cb_allocate_output_stream(AVFormatContext* avf, ContinuousBufferStream* stream)
+{
+    AVStream* st = avformat_new_stream(avf, NULL);
+    if (st == NULL) {
+        fprintf(stderr, "Could not allocate stream\n");
+        return NULL;
+    }
+
+    st->id = avf->nb_streams - 1;
+
+    // Packets are already encoded, so the stream parameters (with extradata) are taken as is from the buffer.
+    if (avcodec_parameters_copy(st->codecpar, stream->codecpar) < 0) {
+        fprintf(stderr, "Could not copy the stream parameters\n");
+        return NULL;
+    }
+    st->codecpar->codec_tag = 0;
+    st->time_base = stream->time_base;
+
+    return st;
+}
+
+int cb_write_stream_to_stream(ContinuousBufferStream* stream, AVFormatContext* fmt_ctx, AVStream* st, int64_t start_time)
+{
+    AVPacket** packets = NULL;
+    int nb_packets = cb_pop_all_packets_from_stream(stream, &packets);
+
+    if (nb_packets < 0)
+    {
+        return nb_packets;
+    }
+
+    int64_t offset = av_rescale_q(start_time, AV_TIME_BASE_Q, stream->time_base);
+
+    int ret = 0;
+    for (int i = 0; i < nb_packets; i++) {
+        AVPacket* pkt = packets[i];
+
+        // Queue starts from the key frame, only packets which are older than the clip start are skipped.
+        if (ret >= 0 && pkt->dts >= offset)
+        {
+            pkt->pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts - offset : AV_NOPTS_VALUE;
+            pkt->dts -= offset;
+
+            av_packet_rescale_ts(pkt, stream->time_base, st->time_base);
+            pkt->stream_index = st->index;
+
+            ret = av_interleaved_write_frame(fmt_ctx, pkt);
+            if (ret < 0) {
+                fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
+            }
+        }
+
+        av_packet_free(&pkt);
+    }
+
+    if (packets != NULL)
+    {
+        av_freep(&packets);
+    }
+
+    return ret;
+}
+
+static int cb_write_file(HANDLE file, const uint8_t* data, int size)
+{
+    DWORD written = 0;
+    if (!WriteFile(file, data, size, &written, NULL) || written != size)
+    {
+        return AVERROR(EIO);
+    }
+
+    return 0;
+}
+
+/**
+ * Write the init segment followed by the fragments of the snapshot. Nothing is muxed, the file is written sequentially
+ * straight from the fragment buffers.
+ */
+static int cb_write_fragments(ContinuousBuffer* buffer, const char* output)
+{
+    HANDLE file = CreateFile(output, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Could not open '%s'.\n", output);
+        return AVERROR(EIO);
+    }
+
+    int ret = cb_write_file(file, buffer->init_segment->data, buffer->init_segment->size);
+    for (int64_t seq = pr_get_head(buffer->fragment_queue); ret >= 0 && seq < pr_get_tail(buffer->fragment_queue); seq++)
+    {
+        AVPacket* fragment = pr_peek(buffer->fragment_queue, seq);
+        ret = cb_write_file(file, fragment->data, fragment->size);
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not write the fragments to '%s'.\n", output);
+    }
+
+    CloseHandle(file);
+
+    return ret;
+}
+
+/**
+ * Mux the buffer to the specified container. The output is either the file or the custom I/O context (pb)
+ * which stays owned by the caller.
+ */
+static int cb_write_buffer(ContinuousBuffer* buffer, const char* format, const char* output, AVIOContext* pb)
+{
+    AVFormatContext* outputFormat;
+
+    /* allocate the output media context */
+    avformat_alloc_output_context2(&outputFormat, NULL, format, pb == NULL ? output : NULL);
+    if (!outputFormat)
+    {
+        fprintf(stderr, "Output format was not initialized.\n");
+        return -1;
+    }
+
+    AVStream* video = NULL;
+    if (buffer->video != NULL)
+    {
+        video = cb_allocate_output_stream(outputFormat, buffer->video);
+    }
+
+    AVStream* audio = NULL;
+    if (buffer->audio != NULL)
+    {
+        audio = cb_allocate_output_stream(outputFormat, buffer->audio);
+    }
+
+    if ((buffer->video != NULL && video == NULL) || (buffer->audio != NULL && audio == NULL))
+    {
+        avformat_free_context(outputFormat);
+        return -1;
+    }
+
+    av_dump_format(outputFormat, 0, output, 1);
+
+    int ret = 0;
+    int own_pb = pb == NULL && !(outputFormat->oformat->flags & AVFMT_NOFILE);
+    if (pb != NULL)
+    {
+        outputFormat->pb = pb;
+    }
+
+    /* open the output file, if needed */
+    if (own_pb) {
+        ret = avio_open(&(outputFormat->pb), output, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open '%s': %s\n", output,
+                av_err2str(ret));
+            avformat_free_context(outputFormat);
+            return -1;
+        }
+    }
+
+    /* Write the stream header, if any. */
+    ret = avformat_write_header(outputFormat, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when opening output file: %s\n",
+            av_err2str(ret));
+        if (own_pb)
+            avio_closep(&outputFormat->pb);
+        avformat_free_context(outputFormat);
+        return -1;
+    }
+
+    // All streams are shifted by the same offset to keep them in sync. Clip starts from the first video key frame.
+    int64_t start_time = AV_NOPTS_VALUE;
+    if (buffer->video != NULL)
+    {
+        start_time = cb_get_stream_start_time(buffer->video);
+    }
+
+    if (start_time == AV_NOPTS_VALUE && buffer->audio != NULL)
+    {
+        start_time = cb_get_stream_start_time(buffer->audio);
+    }
+
+    if (start_time == AV_NOPTS_VALUE)
+    {
+        start_time = 0;
+    }
+
+    if (buffer->video != NULL)
+    {
+        ret = cb_write_stream_to_stream(buffer->video, outputFormat, video, start_time);
+    }
+
+    if (buffer->audio != NULL && ret >= 0)
+    {
+        ret = cb_write_stream_to_stream(buffer->audio, outputFormat, audio, start_time);
+    }
+
+    av_write_trailer(outputFormat);
+
+    if (own_pb)
+    {
+        /* Close the output file. */
+        avio_closep(&outputFormat->pb);
+    }
+
+    /* free the stream */
+    avformat_free_context(outputFormat);
+
+    return ret;
+}
+
+/**
+ * Record the stage sample which started at start (ss_now), nothing is recorded if the buffer has no stats.
+ */
+static void cb_record_stage(ContinuousBuffer* buffer, enum ContinuousBufferStage stage, int64_t start, int64_t bytes)
+{
+    if (buffer->stats != NULL)
+    {
+        ss_record(&((StageStats*)buffer->stats->data)[stage], start, bytes);
+    }
+}
+
+static int cb_write_buffer_to_mp4(ContinuousBuffer* buffer, const char* output)
+{
+    int64_t start = ss_now();
+
+    int ret = buffer->fragment_queue != NULL
+        ? cb_write_fragments(buffer, output)
+        : cb_write_buffer(buffer, "mp4", output, NULL);
+
+    if (ret >= 0)
+    {
+        cb_record_stage(buffer, CB_STAGE_FLUSH, start, 0);
+    }
+
+    return ret;
+}
+
+ContinuousBufferOutput* cb_output_alloc(uint8_t* data, int64_t capacity)
+{
+    ContinuousBufferOutput* output = av_mallocz(sizeof(ContinuousBufferOutput));
+    if (output == NULL)
+    {
+        return NULL;
+    }
+
+    output->data = data;
+    output->capacity = data != NULL ? capacity : 0;
+    output->fixed = data != NULL;
+
+    return output;
+}
+
+void cb_output_free(ContinuousBufferOutput** output)
+{
+    ContinuousBufferOutput* o = *output;
+    if (o == NULL)
+    {
+        return;
+    }
+
+    if (!o->fixed)
+    {
+        av_freep(&o->data);
+    }
+
+    av_freep(output);
+}
+
+/**
+ * Make sure the output could hold the specified number of bytes, the dynamic buffer grows by doubling.
+ */
+static int cb_output_reserve(ContinuousBufferOutput* output, int64_t size)
+{
+    if (size <= output->capacity)
+    {
+        return 0;
+    }
+
+    if (output->fixed)
+    {
+        return AVERROR(ENOSPC);
+    }
+
+    int64_t capacity = FFMAX(FFMAX(output->capacity * 2, size), CB_OUTPUT_INITIAL_SIZE);
+    uint8_t* data = av_realloc(output->data, capacity);
+    if (data == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    output->data = data;
+    output->capacity = capacity;
+
+    return 0;
+}
+
+static int cb_output_write(void* opaque, uint8_t* buf, int buf_size)
+{
+    ContinuousBufferOutput* output = opaque;
+
+    int ret = cb_output_reserve(output, output->pos + buf_size);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    memcpy(output->data + output->pos, buf, buf_size);
+    output->pos += buf_size;
+    output->size = FFMAX(output->size, output->pos);
+
+    return buf_size;
+}
+
+/**
+ * Muxers (e.g. mp4) seek back to patch the sizes of the written boxes.
+ */
+static int64_t cb_output_seek(void* opaque, int64_t offset, int whence)
+{
+    ContinuousBufferOutput* output = opaque;
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        return output->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += output->pos;
+        break;
+    case SEEK_END:
+        offset += output->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < 0 || offset > output->size)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    output->pos = offset;
+
+    return offset;
+}
+
+/**
+ * Copy the init segment and the fragments of the snapshot, nothing is muxed.
+ */
+static int cb_copy_fragments(ContinuousBuffer* buffer, ContinuousBufferOutput* output)
+{
+    int ret = cb_output_write(output, buffer->init_segment->data, buffer->init_segment->size);
+    for (int64_t seq = pr_get_head(buffer->fragment_queue); ret >= 0 && seq < pr_get_tail(buffer->fragment_queue); seq++)
+    {
+        AVPacket* fragment = pr_peek(buffer->fragment_queue, seq);
+        ret = cb_output_write(output, fragment->data, fragment->size);
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+static int cb_write_buffer_to_memory(ContinuousBuffer* buffer, const char* format, ContinuousBufferOutput* output)
+{
+    if (buffer->fragment_queue != NULL)
+    {
+        return cb_copy_fragments(buffer, output);
+    }
+
+    uint8_t* io_buffer = av_malloc(CB_IO_BUFFER_SIZE);
+    if (io_buffer == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    AVIOContext* pb = avio_alloc_context(io_buffer, CB_IO_BUFFER_SIZE, 1, output, NULL, cb_output_write, cb_output_seek);
+    if (pb == NULL)
+    {
+        av_freep(&io_buffer);
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = cb_write_buffer(buffer, format, "memory", pb);
+
+    avio_flush(pb);
+    if (ret >= 0 && pb->error < 0)
+    {
+        ret = pb->error;
+    }
+
+    // I/O buffer could be reallocated by the context, so it is freed through the context.
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+
+    return ret;
+}
+
+int cb_write_to_memory(ContinuousBuffer* buffer, const char* format, ContinuousBufferOutput* output)
+{
+    if (format == NULL)
+    {
+        format = "mp4";
+    }
+
+    // Output is reused, the previous content is overwritten.
+    output->size = 0;
+    output->pos = 0;
+
+    // Fragments make only the MP4, any other container is muxed from the packets.
+    ContinuousBuffer* snapshot = strcmp(format, "mp4") == 0 ? cb_snapshot_for_flush(buffer) : cb_snapshot(buffer);
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "Could not take a buffer snapshot.\n");
+        return -1;
+    }
+
+    int64_t start = ss_now();
+
+    int ret = cb_write_buffer_to_memory(snapshot, format, output);
+    if (ret >= 0)
+    {
+        cb_record_stage(snapshot, CB_STAGE_FLUSH, start, output->size);
+    }
+
+    cb_free_snapshot(&snapshot);
+
+    return ret;
+}
+
+int cb_write_to_mp4(ContinuousBuffer* buffer, const char* output)
+{
+    // Flush works on the snapshot, so the live buffer keeps its history and continues recording.
+    ContinuousBuffer* snapshot = cb_snapshot_for_flush(buffer);
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "Could not take a buffer snapshot.\n");
+        return -1;
+    }
+
+    int ret = cb_write_buffer_to_mp4(snapshot, output);
+
+    cb_free_snapshot(&snapshot);
+
+    return ret;
+}
+
+int cb_extract_stream_range(ContinuousBuffer* buffer, enum AVMediaType type, int64_t start, int64_t end, const char* output)
+{
+    ContinuousBuffer* snapshot = cb_snapshot_range(buffer, type, start, end);
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "Could not take a snapshot of the buffer range.\n");
+        return -1;
+    }
+
+    int ret = cb_write_buffer_to_mp4(snapshot, output);
+
+    cb_free_snapshot(&snapshot);
+
+    return ret;
+}
+
+int cb_extract_range(ContinuousBuffer* buffer, int64_t start, int64_t end, const char* output)
+{
+    return cb_extract_stream_range(buffer, AVMEDIA_TYPE_UNKNOWN, start, end, output);
+}
+
+static DWORD WINAPI cb_flush_thread(LPVOID arg)
+{
+    ContinuousBufferFlush* flush = arg;
+
+    flush->result = cb_write_buffer_to_mp4(flush->snapshot, flush->output);
+    cb_free_snapshot(&flush->snapshot);
+
+    if (flush->callback != NULL)
+    {
+        flush->callback(flush->result, flush->output, flush->opaque);
+    }
+
+    InterlockedExchange(&flush->done, 1);
+
+    return 0;
+}
+
+ContinuousBufferFlush* cb_write_to_mp4_async(ContinuousBuffer* buffer, const char* output, void (*callback)(int result, const char* output, void* opaque), void* opaque)
+{
+    ContinuousBufferFlush* flush = av_mallocz(sizeof(ContinuousBufferFlush));
+    if (flush == NULL)
+    {
+        return NULL;
+    }
+
+    // Only the snapshot is taken on the caller thread. Muxing and disk I/O happen on the worker thread.
+    flush->snapshot = cb_snapshot_for_flush(buffer);
+    flush->output = av_strdup(output);
+    flush->callback = callback;
+    flush->opaque = opaque;
+
+    if (flush->snapshot == NULL || flush->output == NULL)
+    {
+        fprintf(stderr, "Could not prepare the buffer flush.\n");
+        cb_free_snapshot(&flush->snapshot);
+        av_freep(&flush->output);
+        av_freep(&flush);
+        return NULL;
+    }
+
+    flush->thread = CreateThread(NULL, 0, cb_flush_thread, flush, 0, NULL);
+    if (flush->thread == NULL)
+    {
+        fprintf(stderr, "Could not start the flush thread.\n");
+        cb_free_snapshot(&flush->snapshot);
+        av_freep(&flush->output);
+        av_freep(&flush);
+        return NULL;
+    }
+
+    return flush;
+}
+
+int cb_flush_is_done(ContinuousBufferFlush* flush)
+{
+    return InterlockedCompareExchange(&flush->done, 0, 0) != 0;
+}
+
+int cb_flush_wait(ContinuousBufferFlush* flush)
+{
+    WaitForSingleObject(flush->thread, INFINITE);
+
+    return flush->result;
+}
+
+void cb_free_flush(ContinuousBufferFlush** flush)
+{
+    ContinuousBufferFlush* f = *flush;
+    if (f == NULL)
+    {
+        return;
+    }
+
+    cb_flush_wait(f);
+    CloseHandle(f->thread);
+
+    av_freep(&f->output);
+    av_freep(flush);
+}
+
+AVDictionary* cb_options(int64_t duration)
+{
+    AVDictionary* opt = NULL;
+    av_dict_set_int(&opt, "duration", duration, 0);
+
+    return opt;
+}
+
+static int cb_is_empty(ContinuousBuffer* buffer) 
+{
+    if (buffer->audio != NULL && cb_get_nb_packets(buffer->audio) > 0)
+    {
+        return 0;
+    }
+
+    if (buffer->video != NULL && cb_get_nb_packets(buffer->video) > 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Packet ring does not grow, so it is sized for twice the duration: the latest GOP is never evicted,
+ * so the queue could hold up to the duration plus one GOP.
+ */
+static int64_t cb_get_ring_capacity(int64_t packet_rate, int64_t duration)
+{
+    return packet_rate * duration / 1000 * 2 + CB_RING_MARGIN;
+}
+
+/**
+ * Allocate the queues of the stream for the expected number of packets per second.
+ */
+static int cb_alloc_stream_queues(ContinuousBuffer* buffer, ContinuousBufferStream* stream, int64_t packet_rate, int nb_keyframes)
+{
+    // With the spill, the memory ring holds only the memory duration plus the packets waiting to be spilled.
+    int64_t memory_duration = buffer->spill != NULL ? FFMIN(buffer->memory_duration + CB_SPILL_INTERVAL, buffer->duration) : buffer->duration;
+
+    stream->queue = pr_alloc(cb_get_ring_capacity(packet_rate, memory_duration), buffer->pool);
+    stream->keyframes = av_fifo_alloc_array(nb_keyframes, sizeof(int64_t));
+    stream->packet = av_packet_alloc();
+    if (stream->queue == NULL || stream->keyframes == NULL || stream->packet == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    if (buffer->spill != NULL)
+    {
+        stream->spill = buffer->spill;
+        stream->spill_queue = pr_alloc(cb_get_ring_capacity(packet_rate, buffer->duration), NULL);
+        stream->spill_batches = av_fifo_alloc_array(CB_KEYFRAMES_INITIAL_SIZE, sizeof(int64_t));
+        stream->spill_packet = av_packet_alloc();
+        if (stream->spill_queue == NULL || stream->spill_batches == NULL || stream->spill_packet == NULL)
+        {
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    return 0;
+}
+
+void cb_set_packet_pool(ContinuousBuffer* buffer, PacketPool* pool)
+{
+    buffer->pool = pool;
+}
+
+/**
+ * Allocate the stream with the parameters of the encoded stream, its queues are allocated separately.
+ */
+static ContinuousBufferStream* cb_alloc_stream(const AVCodecParameters* par, AVRational time_base)
+{
+    ContinuousBufferStream* stream = av_mallocz(sizeof(ContinuousBufferStream));
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+
+    stream->type = par->codec_type;
+    stream->codec = par->codec_id;
+    stream->bit_rate = par->bit_rate;
+    stream->time_base = time_base;
+    stream->duration = 0;
+
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        stream->width = par->width;
+        stream->height = par->height;
+        stream->pixel_format = par->format;
+    }
+    else if (par->codec_type == AVMEDIA_TYPE_AUDIO)
+    {
+        stream->sample_rate = par->sample_rate;
+        stream->channel_layout = par->channel_layout;
+        stream->sample_fmt = par->format;
+        stream->frame_size = par->frame_size;
+    }
+
+    // Keep the encoder parameters (with extradata), so the buffer could be remuxed without an encoder.
+    stream->codecpar = avcodec_parameters_alloc();
+    if (stream->codecpar == NULL || avcodec_parameters_copy(stream->codecpar, par) < 0)
+    {
+        avcodec_parameters_free(&stream->codecpar);
+        av_freep(&stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/**
+ * Allocate the recovered stream for the log stream, its ring is sized for all the logged packets.
+ */
+static ContinuousBufferStream* cb_alloc_recovered_stream(PacketLog* log, int index, int64_t head, int64_t tail)
+{
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    AVRational time_base;
+    if (par == NULL || pl_get_stream_parameters(log, index, par, &time_base) < 0)
+    {
+        avcodec_parameters_free(&par);
+        return NULL;
+    }
+
+    ContinuousBufferStream* stream = cb_alloc_stream(par, time_base);
+    avcodec_parameters_free(&par);
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+
+    // Live writer could rewrite the index entries before they are read, so counting the packets of the stream is
+    // not reliable. Every logged packet could belong to the stream, which bounds the ring size.
+    stream->log_index = index;
+    stream->queue = pr_alloc(FFMAX(tail - head, 1), NULL);
+    stream->keyframes = av_fifo_alloc_array(CB_KEYFRAMES_INITIAL_SIZE, sizeof(int64_t));
+    stream->packet = av_packet_alloc();
+    if (stream->queue == NULL || stream->keyframes == NULL || stream->packet == NULL)
+    {
+        cb_deinit_stream(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/**
+ * Build the snapshot of the logged packets. The log could be still written by another process,
+ * the packets overwritten while they are read are skipped.
+ */
+static ContinuousBuffer* cb_snapshot_log(PacketLog* log)
+{
+    ContinuousBuffer* recovered = av_mallocz(sizeof(ContinuousBuffer));
+    ContinuousBufferStream* streams[PL_MAX_STREAMS] = { NULL };
+    if (recovered == NULL)
+    {
+        return NULL;
+    }
+
+    int64_t head = ReadAcquire64(&log->header->head);
+    int64_t tail = ReadAcquire64(&log->header->tail);
+
+    recovered->duration = log->header->duration;
+    recovered->window = log->header->duration;
+
+    for (int i = 0; i < log->header->nb_streams; i++)
+    {
+        streams[i] = cb_alloc_recovered_stream(log, i, head, tail);
+        if (streams[i] == NULL)
+        {
+            break;
+        }
+
+        if (streams[i]->type == AVMEDIA_TYPE_VIDEO && recovered->video == NULL)
+        {
+            recovered->video = streams[i];
+        }
+        else if (streams[i]->type == AVMEDIA_TYPE_AUDIO && recovered->audio == NULL)
+        {
+            recovered->audio = streams[i];
+        }
+        else
+        {
+            cb_deinit_stream(streams[i]);
+            streams[i] = NULL;
+        }
+    }
+
+    // Payloads of a log which is not written anymore are not copied, the packets reference the mapping of the log file.
+    for (int64_t seq = head; seq < tail; seq++)
+    {
+        int index = log->index[seq % log->header->index_capacity].stream_index;
+        if (index < 0 || index >= PL_MAX_STREAMS || streams[index] == NULL)
+        {
+            continue;
+        }
+
+        ContinuousBufferStream* stream = streams[index];
+        if (pl_read_packet(log, seq, stream->packet) < 0)
+        {
+            // Live writer has overwritten the packet meanwhile. Its entry could be overwritten as well, so the stream
+            // which lost the packet is not known: every stream drops the rest of its GOP, like cb_write_packet does.
+            for (int i = 0; i < PL_MAX_STREAMS; i++)
+            {
+                if (streams[i] != NULL)
+                {
+                    streams[i]->dropping = 1;
+                }
+            }
+
+            continue;
+        }
+
+        // Oldest GOP could be partially overwritten, the recovered queue must start from a key frame.
+        if (stream->packet->flags & AV_PKT_FLAG_KEY)
+        {
+            stream->dropping = 0;
+        }
+        else if (cb_get_nb_packets(stream) == 0 || stream->dropping)
+        {
+            av_packet_unref(stream->packet);
+            continue;
+        }
+
+        if (cb_append_packet(stream, stream->packet) < 0)
+        {
+            // Rest of the GOP would miss its reference, the stream resumes from the next key frame.
+            av_packet_unref(stream->packet);
+            stream->dropping = 1;
+        }
+    }
+
+    for (int i = 0; i < PL_MAX_STREAMS; i++)
+    {
+        if (streams[i] != NULL)
+        {
+            cb_evict_to_duration(streams[i], recovered->duration);
+        }
+    }
+
+    if (cb_is_empty(recovered))
+    {
+        cb_free_snapshot(&recovered);
+        return NULL;
+    }
+
+    return recovered;
+}
+
+ContinuousBuffer* cb_recover(const char* path)
+{
+    PacketLog* log = pl_attach(path);
+    if (log == NULL)
+    {
+        return NULL;
+    }
+
+    ContinuousBuffer* recovered = cb_snapshot_log(log);
+
+    pl_close(&log);
+
+    return recovered;
+}
+
+ContinuousBuffer* cb_attach_shared(const char* name)
+{
+    PacketLog* log = pl_attach_shared(name);
+    if (log == NULL)
+    {
+        return NULL;
+    }
+
+    ContinuousBuffer* snapshot = cb_snapshot_log(log);
+
+    pl_close(&log);
+
+    return snapshot;
+}
+
+ContinuousBuffer* cb_take_recovered(ContinuousBuffer* buffer)
+{
+    ContinuousBuffer* recovered = buffer->recovered;
+    buffer->recovered = NULL;
+
+    return recovered;
+}
+
+/**
+ * Start the fragment writer of the fragmented mode and cache its init segment.
+ */
+static int cb_open_fragments(ContinuousBuffer* buffer)
+{
+    buffer->fragment_writer = fw_alloc();
+    buffer->fragment_queue = pr_alloc(cb_get_ring_capacity(1000 / CB_FRAGMENT_DURATION, buffer->duration), NULL);
+    buffer->fragment = av_packet_alloc();
+    if (buffer->fragment_writer == NULL || buffer->fragment_queue == NULL || buffer->fragment == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    // Queued packets start from a key frame, so does the first fragment.
+    buffer->fragment_independent = 1;
+
+    ContinuousBufferStream* streams[] = { buffer->video, buffer->audio };
+    for (int i = 0; i < FF_ARRAY_ELEMS(streams); i++)
+    {
+        if (streams[i] == NULL)
+        {
+            continue;
+        }
+
+        streams[i]->fragment_index = fw_add_stream(buffer->fragment_writer, streams[i]->codecpar, streams[i]->time_base);
+        if (streams[i]->fragment_index < 0)
+        {
+            return streams[i]->fragment_index;
+        }
+    }
+
+    int ret = fw_write_header(buffer->fragment_writer);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    buffer->init_segment = av_buffer_ref(buffer->fragment_writer->init_segment);
+    if (buffer->init_segment == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    if (buffer->hls_dir != NULL)
+    {
+        buffer->hls = hw_open(buffer->hls_dir, buffer->init_segment, CB_FRAGMENT_MAX_DURATION * 1000);
+        if (buffer->hls == NULL)
+        {
+            return AVERROR(EIO);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Add the streams of the buffer to the log. All the logs get the streams in the same order, so the stream
+ * log index is the same for all of them.
+ */
+static int cb_add_log_streams(ContinuousBuffer* buffer, PacketLog* log)
+{
+    ContinuousBufferStream* streams[] = { buffer->video, buffer->audio };
+    for (int i = 0; i < FF_ARRAY_ELEMS(streams); i++)
+    {
+        if (streams[i] == NULL)
+        {
+            continue;
+        }
+
+        streams[i]->log_index = pl_add_stream(log, streams[i]->codecpar, streams[i]->time_base);
+        if (streams[i]->log_index < 0)
+        {
+            return streams[i]->log_index;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Recover the log of the previous process and start a new one.
+ */
+static int cb_open_log(ContinuousBuffer* buffer, int64_t index_capacity)
+{
+    // Recovered packets keep the old log mapped, so the new log is written to a fresh file.
+    char* recovered_path = av_asprintf("%s.recovered", buffer->persist_file);
+    if (recovered_path == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    if (MoveFileEx(buffer->persist_file, recovered_path, MOVEFILE_REPLACE_EXISTING))
+    {
+        buffer->recovered = cb_recover(recovered_path);
+    }
+    else if (GetLastError() != ERROR_FILE_NOT_FOUND)
+    {
+        fprintf(stderr, "Could not move the packet log '%s' for the recovery.\n", buffer->persist_file);
+    }
+
+    av_freep(&recovered_path);
+
+    buffer->log = pl_create(buffer->persist_file, buffer->persist_size, index_capacity, buffer->duration);
+    if (buffer->log == NULL)
+    {
+        fprintf(stderr, "Could not create the packet log '%s'.\n", buffer->persist_file);
+        return AVERROR(EIO);
+    }
+
+    return cb_add_log_streams(buffer, buffer->log);
+}
+
+static int cb_init(AVFormatContext* avf)
+{
+    ContinuousBuffer* buffer = avf->priv_data;
+    buffer->window = buffer->duration;
+
+    buffer->stats = av_buffer_allocz(CB_NB_STAGES * sizeof(StageStats));
+    if (buffer->stats == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    StageStats* stats = (StageStats*)buffer->stats->data;
+    ss_init(&stats[CB_STAGE_WRITE_PACKET], "Buffer write packet");
+    ss_init(&stats[CB_STAGE_FLUSH], "Buffer flush");
+
+    // Unless the caller has plugged its own pool, all the buffers of the process share the same one.
+    if (buffer->pool == NULL)
+    {
+        buffer->pool = pp_get_shared(buffer->large_pages ? PP_FLAG_LARGE_PAGES : 0);
+        if (buffer->pool == NULL)
+        {
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    // Spill tier makes sense only if a part of the window is not kept in memory.
+    if (buffer->spill_file != NULL && buffer->memory_duration < buffer->duration)
+    {
+        buffer->spill = sf_open(buffer->spill_file, buffer->spill_size);
+        if (buffer->spill == NULL)
+        {
+            fprintf(stderr, "Could not open the spill file '%s'.\n", buffer->spill_file);
+            return AVERROR(EIO);
+        }
+    }
+
+    int64_t log_capacity = 0;
+
+    for (int i = 0; i < avf->nb_streams; i++)
+    {
+        if (avf->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            ContinuousBufferStream* buffer_stream = cb_alloc_stream(avf->streams[i]->codecpar, avf->streams[i]->time_base);
+            if (buffer_stream == NULL)
+            {
+                return AVERROR(ENOMEM);
+            }
+
+            AVRational frame_rate = avf->streams[i]->avg_frame_rate;
+            int64_t packet_rate = frame_rate.num > 0 && frame_rate.den > 0
+                ? av_rescale(1, frame_rate.num, frame_rate.den) + 1
+                : avf->streams[i]->time_base.den;
+            packet_rate = FFMIN(packet_rate, CB_MAX_PACKET_RATE);
+
+            buffer->video = buffer_stream;
+            log_capacity += cb_get_ring_capacity(packet_rate, buffer->duration);
+
+            int ret = cb_alloc_stream_queues(buffer, buffer_stream, packet_rate, CB_KEYFRAMES_INITIAL_SIZE);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+        else if (avf->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        {
+            ContinuousBufferStream* buffer_stream = cb_alloc_stream(avf->streams[i]->codecpar, avf->streams[i]->time_base);
+            if (buffer_stream == NULL)
+            {
+                return AVERROR(ENOMEM);
+            }
+
+            int frame_size = avf->streams[i]->codecpar->frame_size > 0 ? avf->streams[i]->codecpar->frame_size : CB_DEFAULT_FRAME_SIZE;
+            int64_t packet_rate = avf->streams[i]->codecpar->sample_rate / frame_size + 1;
+
+            buffer->audio = buffer_stream;
+            log_capacity += cb_get_ring_capacity(packet_rate, buffer->duration);
+
+            // Every audio packet is a key frame, so the index has the same length as the queue.
+            int ret = cb_alloc_stream_queues(buffer, buffer_stream, packet_rate, cb_get_ring_capacity(packet_rate, buffer->duration));
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+    }
+
+    if (buffer->fragments || buffer->hls_dir != NULL)
+    {
+        int ret = cb_open_fragments(buffer);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    if (buffer->persist_file != NULL)
+    {
+        int ret = cb_open_log(buffer, log_capacity);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    if (buffer->shared_name != NULL)
+    {
+        buffer->shared = pl_create_shared(buffer->shared_name, buffer->shared_size, log_capacity, buffer->duration);
+        if (buffer->shared == NULL)
+        {
+            return AVERROR(EIO);
+        }
+
+        int ret = cb_add_log_streams(buffer, buffer->shared);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int64_t cb_get_process_memory()
+{
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)))
+    {
+        return -1;
+    }
+
+    return pmc.PrivateUsage;
+}
+
+/**
+ * Adjust the buffer window according to the process memory usage. The window is shortened by a quarter
+ * each time the usage is above the memory limit, and grows back by a tenth of the duration once the usage
+ * drops below 90% of the limit.
+ */
+static void cb_update_window(ContinuousBuffer* buffer)
+{
+    if (buffer->memory_limit <= 0)
+    {
+        return;
+    }
+
+    int64_t now = av_gettime_relative();
+    if (now - buffer->memory_checked < CB_MEMORY_CHECK_INTERVAL)
+    {
+        return;
+    }
+    buffer->memory_checked = now;
+
+    int64_t usage = cb_get_process_memory();
+    if (usage < 0)
+    {
+        return;
+    }
+
+    if (usage > buffer->memory_limit)
+    {
+        buffer->window = FFMAX(buffer->window - buffer->window / 4, 1);
+    }
+    else if (usage < buffer->memory_limit / 10 * 9)
+    {
+        buffer->window = FFMIN(buffer->window + FFMAX(buffer->duration / 10, 1), buffer->duration);
+    }
+}
+
+/**
+ * Retain the packet to the stream reusable packet, so it could be pushed to the queue.
+ */
+static int cb_retain_packet(ContinuousBuffer* buffer, ContinuousBufferStream* stream, AVPacket* pkt)
+{
+    AVPacket* retained = stream->packet;
+
+    if (buffer->zero_copy && pkt->buf != NULL)
+    {
+        // Packet belongs to libavformat, the queue adds its own reference to the payload.
+        int ret = av_packet_ref(retained, pkt);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    else
+    {
+        int ret = av_packet_copy_props(retained, pkt);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        retained->buf = pp_get_buffer(buffer->pool, pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (retained->buf == NULL)
+        {
+            av_packet_unref(retained);
+            return AVERROR(ENOMEM);
+        }
+
+        retained->data = retained->buf->data;
+        retained->size = pkt->size;
+
+        if (pkt->size)
+            memcpy(retained->data, pkt->data, pkt->size);
+        memset(retained->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+        stream->bytes_copied += pkt->size;
+    }
+
+    stream->bytes_retained += retained->size;
+
+    return 0;
+}
+
+/**
+ * Append the buffered packet to the log. The payload is copied even in the zero copy mode, so it is counted as copied.
+ */
+static void cb_log_packet(PacketLog* log, ContinuousBufferStream* stream, const AVPacket* pkt)
+{
+    if (pl_append(log, stream->log_index, pkt) < 0)
+    {
+        if (stream->nb_log_dropped++ == 0)
+        {
+            fprintf(stderr, "Packet of %d bytes does not fit the packet log, such packets are not logged.\n", pkt->size);
+        }
+
+        return;
+    }
+
+    stream->bytes_copied += pkt->size;
+}
+
+/**
+ * Remove the oldest fragments while the rest still covers the specified duration (in ms).
+ */
+static void cb_evict_fragments(ContinuousBuffer* buffer, int64_t duration)
+{
+    PacketRing* queue = buffer->fragment_queue;
+    int64_t head = pr_get_head(queue);
+    int64_t tail = pr_get_tail(queue);
+    if (tail == head)
+    {
+        return;
+    }
+
+    AVPacket* last = pr_peek(queue, tail - 1);
+    int64_t end = last->dts + last->duration;
+
+    // Flushed file must start from a key frame, so the queue starts from an independent fragment.
+    int64_t seq = head;
+    for (int64_t next = head + 1; next < tail && end - pr_peek(queue, next)->dts >= duration * 1000; next++)
+    {
+        if (pr_peek(queue, next)->flags & AV_PKT_FLAG_KEY)
+        {
+            seq = next;
+        }
+    }
+
+    pr_advance_head(queue, seq);
+}
+
+/**
+ * Cut the pending fragment and move it to the fragment queue.
+ */
+static int cb_push_fragment(ContinuousBuffer* buffer)
+{
+    int ret = fw_flush_fragment(buffer->fragment_writer, buffer->fragment);
+    if (ret < 0)
+    {
+        return ret == AVERROR(EAGAIN) ? 0 : ret;
+    }
+
+    if (!buffer->fragment_independent)
+    {
+        buffer->fragment->flags &= ~AV_PKT_FLAG_KEY;
+    }
+
+    PacketRing* queue = buffer->fragment_queue;
+    if (pr_is_full(queue))
+    {
+        // Rest of the oldest GOP goes with its first fragment.
+        int64_t head = pr_get_head(queue) + 1;
+        while (head < pr_get_tail(queue) && !(pr_peek(queue, head)->flags & AV_PKT_FLAG_KEY))
+        {
+            head++;
+        }
+
+        pr_advance_head(queue, head);
+    }
+
+    int64_t seq = pr_get_tail(queue);
+    ret = pr_push(queue, buffer->fragment, seq);
+    if (ret == AVERROR(EAGAIN))
+    {
+        // Readers still hold the oldest fragments, the flush would contain a gap instead.
+        buffer->nb_dropped_fragments++;
+        av_packet_unref(buffer->fragment);
+        return 0;
+    }
+
+    cb_evict_fragments(buffer, buffer->window);
+
+    // HLS files are written by the writer thread, so the capture never waits for the disk.
+    // Output failures are reported by the writer, they do not stop the recording.
+    if (buffer->hls != NULL)
+    {
+        hw_add_segment(buffer->hls, seq, pr_peek(queue, seq), pr_get_head(queue));
+    }
+
+    return ret;
+}
+
+/**
+ * Mux the queued packet to the pending fragment. Fragments are cut at the key frames of the video
+ * (of the audio if there is no video), so every fragment could start the flushed file. A GOP longer than
+ * CB_FRAGMENT_MAX_DURATION is cut inside as well, the fragments after the cut do not start the flushed file.
+ */
+static int cb_write_fragment_packet(ContinuousBuffer* buffer, ContinuousBufferStream* stream, AVPacket* pkt)
+{
+    ContinuousBufferStream* leading = buffer->video != NULL ? buffer->video : buffer->audio;
+    int key = stream == leading && (pkt->flags & AV_PKT_FLAG_KEY);
+    if ((key && fw_get_pending_duration(buffer->fragment_writer) >= CB_FRAGMENT_DURATION * 1000)
+        || fw_get_pending_duration_with(buffer->fragment_writer, stream->fragment_index, pkt) > CB_FRAGMENT_MAX_DURATION * 1000)
+    {
+        int ret = cb_push_fragment(buffer);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        buffer->fragment_independent = key;
+    }
+
+    return fw_write_packet(buffer->fragment_writer, stream->fragment_index, pkt);
+}
+
+static int cb_buffer_packet(AVFormatContext* avf, AVPacket* pkt)
+{
+    ContinuousBuffer* buffer = avf->priv_data;
+
+    int s_idx = pkt->stream_index;
+
+    ContinuousBufferStream* buffer_stream = NULL;
+    int media_type = avf->streams[s_idx]->codecpar->codec_type;
+    if (media_type == AVMEDIA_TYPE_VIDEO)
+    {
+        buffer_stream = buffer->video;
+    }
+    else if (media_type == AVMEDIA_TYPE_AUDIO)
+    {
+        buffer_stream = buffer->audio;
+    }
+
+    if (buffer_stream == NULL)
+    {
+        return 0;
+    }
+
+    // Queue always starts from the key frame, so everything before the first key frame is dropped.
+    // The same goes for the rest of a GOP which lost a packet.
+    if (pkt->flags & AV_PKT_FLAG_KEY)
+    {
+        buffer_stream->dropping = 0;
+    }
+    else if (cb_get_nb_packets(buffer_stream) == 0 || buffer_stream->dropping)
+    {
+        return 0;
+    }
+
+    int ret = cb_retain_packet(buffer, buffer_stream, pkt);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = cb_append_packet(buffer_stream, buffer_stream->packet);
+    if (ret == AVERROR(EAGAIN) && cb_evict_gop(buffer_stream))
+    {
+        ret = cb_append_packet(buffer_stream, buffer_stream->packet);
+    }
+
+    if (ret == AVERROR(EAGAIN))
+    {
+        // Ring is full and readers still hold the evicted packets. Capture must not wait for them, so the packet is dropped.
+        buffer_stream->nb_dropped++;
+        buffer_stream->dropping = 1;
+        pp_unref_packet(buffer->pool, buffer_stream->packet);
+        return 0;
+    }
+    else if (ret < 0)
+    {
+        pp_unref_packet(buffer->pool, buffer_stream->packet);
+        return ret;
+    }
+
+    AVPacket* queued = pr_peek(buffer_stream->queue, pr_get_tail(buffer_stream->queue) - 1);
+
+    if (buffer->log != NULL)
+    {
+        cb_log_packet(buffer->log, buffer_stream, queued);
+    }
+
+    if (buffer->shared != NULL)
+    {
+        cb_log_packet(buffer->shared, buffer_stream, queued);
+    }
+
+    if (buffer->fragment_writer != NULL)
+    {
+        ret = cb_write_fragment_packet(buffer, buffer_stream, queued);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    // Under memory pressure the window is shorter than the configured duration.
+    cb_update_window(buffer);
+
+    if (buffer_stream->spill_queue != NULL)
+    {
+        // Older GOPs are spilled in batches, so the spill file is written in large sequential chunks.
+        int64_t memory_window = FFMIN(buffer->memory_duration, buffer->window);
+        if (cb_get_duration_from(buffer_stream, 0) >= memory_window + CB_SPILL_INTERVAL)
+        {
+            cb_evict_to_duration(buffer_stream, memory_window);
+        }
+
+        // Memory pressure does not shorten the part of the window on disk.
+        cb_trim_spill(buffer_stream, buffer->duration);
+    }
+    else
+    {
+        cb_evict_to_duration(buffer_stream, buffer->window);
+    }
+
+    if (buffer->max_bytes > 0)
+    {
+        while (cb_get_size(buffer) > buffer->max_bytes && cb_evict_oldest_gop(buffer));
+    }
+
+    return 1;
+}
+
+static int cb_write_packet(AVFormatContext* avf, AVPacket* pkt)
+{
+    if (pkt == NULL)
+    {
+        return 0;
+    }
+
+    int64_t start = ss_now();
+    int size = pkt->size;
+
+    int ret = cb_buffer_packet(avf, pkt);
+    if (ret >= 0)
+    {
+        cb_record_stage(avf->priv_data, CB_STAGE_WRITE_PACKET, start, size);
+    }
+
+    return ret;
+}
+
+static void cb_deinit(AVFormatContext* avf)
+{
+    ContinuousBuffer* b = avf->priv_data;    
+
+    if (b->audio != NULL)
+    {
+        cb_deinit_stream(b->audio);
+        b->audio = NULL;
+    }
+
+    if (b->video != NULL)
+    {
+        cb_deinit_stream(b->video);
+        b->video = NULL;
+    }
+
+    // Spill file stays mapped until the snapshots which still reference it are freed.
+    sf_close(&b->spill);
+
+    // Log is unmapped but its file is kept, so the buffer could be recovered by the next run.
+    pl_close(&b->log);
+    pl_close(&b->shared);
+    cb_free_snapshot(&b->recovered);
+
+    // Flushed fragments are referenced by the snapshots, the pending one is dropped.
+    hw_close(&b->hls);
+    fw_free(&b->fragment_writer);
+    pr_free(&b->fragment_queue);
+    av_packet_free(&b->fragment);
+    av_buffer_unref(&b->init_segment);
+
+    // Flushes which are still running keep their own reference.
+    av_buffer_unref(&b->stats);
+}
+
+int cb_get_stage_stats(ContinuousBuffer* buffer, enum ContinuousBufferStage stage, StageStatsSummary* summary)
+{
+    if (buffer->stats == NULL || stage < 0 || stage >= CB_NB_STAGES)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    ss_get_summary(&((StageStats*)buffer->stats->data)[stage], summary);
+
+    return 0;
+}
+
+void cb_print_stats(ContinuousBuffer* buffer)
+{
+    if (buffer->stats == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < CB_NB_STAGES; i++)
+    {
+        ss_print(&((StageStats*)buffer->stats->data)[i]);
     }
 }
 
@@ -361,5 +2428,204 @@ const AVOutputFormat continuous_buffer_muxer = {
     .write_packet = cb_write_packet,
     .deinit = cb_deinit,
     .priv_class = &continuous_buffer_muxer_class,
-    .flags = AVFMT_NOFILE | AVFMT_NOTIMESTAMPS | AVFMT_ALLOW_FLUSH
-};
\ No newline at end of file
+    .flags = AVFMT_NOFILE | AVFMT_NOTIMESTAMPS | AVFMT_ALLOW_FLUSH | AVFMT_GLOBALHEADER
+};
+
+int cb_open_demuxer(AVFormatContext** ctx, ContinuousBuffer* buffer)
+{
+    AVFormatContext* s = avformat_alloc_context();
+    if (s == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    s->opaque = buffer;
+
+    // Context is freed by avformat_open_input on failure.
+    int ret = avformat_open_input(&s, "continuous-buffer", &continuous_buffer_demuxer, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not open the buffer demuxer: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    *ctx = s;
+
+    return 0;
+}
+
+static int cb_open_demuxer_streams(AVFormatContext* s, ContinuousBufferDemuxer* demuxer)
+{
+    ContinuousBufferStream* streams[] = { demuxer->snapshot->video, demuxer->snapshot->audio };
+    for (int i = 0; i < FF_ARRAY_ELEMS(streams); i++)
+    {
+        if (streams[i] == NULL)
+        {
+            continue;
+        }
+
+        AVStream* st = avformat_new_stream(s, NULL);
+        if (st == NULL)
+        {
+            return AVERROR(ENOMEM);
+        }
+
+        int ret = avcodec_parameters_copy(st->codecpar, streams[i]->codecpar);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        st->id = st->index;
+        st->time_base = streams[i]->time_base;
+        st->duration = streams[i]->duration;
+
+        // Nobody else reads the snapshot, so the views stay pinned until the demuxer is closed.
+        ret = cb_acquire_view(streams[i], &demuxer->views[st->index]);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        demuxer->streams[st->index] = streams[i];
+
+        if (cb_get_view_nb_packets(&demuxer->views[st->index]) > 0)
+        {
+            st->start_time = cb_peek_view_packet(&demuxer->views[st->index], 0)->dts;
+        }
+    }
+
+    return 0;
+}
+
+static int cb_read_header(AVFormatContext* s)
+{
+    ContinuousBufferDemuxer* demuxer = s->priv_data;
+    ContinuousBuffer* buffer = s->opaque;
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Buffer must be passed as the opaque of the demuxer context.\n");
+        return AVERROR(EINVAL);
+    }
+
+    // Live buffer keeps recording, the demuxer reads the snapshot of its content (a snapshot could be opened as well).
+    demuxer->snapshot = cb_snapshot(buffer);
+    if (demuxer->snapshot == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    // Demuxer is not closed if the header fails.
+    int ret = cb_open_demuxer_streams(s, demuxer);
+    if (ret < 0)
+    {
+        cb_read_close(s);
+    }
+
+    return ret;
+}
+
+/**
+ * Packets of the streams are interleaved by their decoding time.
+ */
+static int cb_read_packet(AVFormatContext* s, AVPacket* pkt)
+{
+    ContinuousBufferDemuxer* demuxer = s->priv_data;
+
+    int next = -1;
+    AVPacket* next_packet = NULL;
+    for (int i = 0; i < s->nb_streams; i++)
+    {
+        if (demuxer->positions[i] >= cb_get_view_nb_packets(&demuxer->views[i]))
+        {
+            continue;
+        }
+
+        AVPacket* candidate = cb_peek_view_packet(&demuxer->views[i], demuxer->positions[i]);
+        if (next_packet == NULL
+            || av_compare_ts(candidate->dts, demuxer->streams[i]->time_base, next_packet->dts, demuxer->streams[next]->time_base) < 0)
+        {
+            next = i;
+            next_packet = candidate;
+        }
+    }
+
+    if (next_packet == NULL)
+    {
+        return AVERROR_EOF;
+    }
+
+    int ret = av_packet_ref(pkt, next_packet);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    pkt->stream_index = next;
+    pkt->pos = -1;
+    demuxer->positions[next]++;
+
+    return 0;
+}
+
+/**
+ * Seek to the key frame at or before the timestamp. The video is positioned first and the other streams
+ * follow its key frame, so they stay in sync.
+ */
+static int cb_read_seek(AVFormatContext* s, int stream_index, int64_t timestamp, int flags)
+{
+    ContinuousBufferDemuxer* demuxer = s->priv_data;
+
+    AVRational time_base = stream_index >= 0 ? s->streams[stream_index]->time_base : AV_TIME_BASE_Q;
+    int64_t time = av_rescale_q(timestamp, time_base, (AVRational){ 1, 1000 });
+
+    for (int i = 0; i < s->nb_streams; i++)
+    {
+        if (demuxer->streams[i]->type == AVMEDIA_TYPE_VIDEO && cb_get_view_nb_packets(&demuxer->views[i]) > 0)
+        {
+            demuxer->positions[i] = cb_find_keyframe_before(demuxer->streams[i], &demuxer->views[i], time);
+            time = cb_get_packet_time(demuxer->streams[i], &demuxer->views[i], demuxer->positions[i]);
+        }
+    }
+
+    for (int i = 0; i < s->nb_streams; i++)
+    {
+        if (demuxer->streams[i]->type != AVMEDIA_TYPE_VIDEO)
+        {
+            demuxer->positions[i] = cb_get_view_nb_packets(&demuxer->views[i]) > 0
+                ? cb_find_keyframe_before(demuxer->streams[i], &demuxer->views[i], time)
+                : 0;
+        }
+    }
+
+    return 0;
+}
+
+static int cb_read_close(AVFormatContext* s)
+{
+    ContinuousBufferDemuxer* demuxer = s->priv_data;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(demuxer->streams); i++)
+    {
+        if (demuxer->streams[i] != NULL)
+        {
+            cb_release_view(&demuxer->views[i]);
+            demuxer->streams[i] = NULL;
+        }
+    }
+
+    cb_free_snapshot(&demuxer->snapshot);
+
+    return 0;
+}
+
+const AVInputFormat continuous_buffer_demuxer = {
+    .name = "continuous-buffer",
+    .long_name = "Continuous buffer",
+    .priv_data_size = sizeof(ContinuousBufferDemuxer),
+    .read_header = cb_read_header,
+    .read_packet = cb_read_packet,
+    .read_seek = cb_read_seek,
+    .read_close = cb_read_close,
+    .flags = AVFMT_NOFILE | AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK
+};
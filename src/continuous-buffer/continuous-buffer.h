@@ -5,6 +5,7 @@
 #include <libavutil/opt.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/timestamp.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
@@ -20,17 +21,77 @@
 #pragma comment (lib, "postproc.lib")
 #pragma comment (lib, "swresample.lib")
 #pragma comment (lib, "swscale.lib")
+#pragma comment (lib, "psapi.lib")
 
 #include "utils.h"
 #include "framework.h"
+#include "packet-ring.h"
+#include "spill-file.h"
+#include "packet-log.h"
+#include "fragment-writer.h"
+#include "hls-writer.h"
+#include "stage-stats.h"
+
+#include <psapi.h>
+
+// Process memory usage is checked at most once per this interval (in microseconds).
+#define CB_MEMORY_CHECK_INTERVAL 100000
+
+// Initial capacity of the video key frame index, it grows on demand.
+#define CB_KEYFRAMES_INITIAL_SIZE 64
+
+// Packet rate limit (per second) which is used to size the video ring when the stream frame rate is not known.
+#define CB_MAX_PACKET_RATE 240
+
+// Audio frame size which is used to size the audio ring for codecs with a variable frame size.
+#define CB_DEFAULT_FRAME_SIZE 1024
+
+// Extra ring slots on top of the estimated number of packets.
+#define CB_RING_MARGIN 64
+
+// Size of the I/O buffer of the in-memory flush and the initial capacity of its growing output.
+#define CB_IO_BUFFER_SIZE 65536
+#define CB_OUTPUT_INITIAL_SIZE (1024 * 1024)
+
+// Minimal duration (in ms) of a fMP4 fragment, a fragment is cut at the first key frame after it.
+#define CB_FRAGMENT_DURATION 1000
+
+// Maximal duration (in ms) of a fMP4 fragment. Longer GOPs are cut before it is exceeded, so the target duration
+// of the HLS playlist is fixed.
+#define CB_FRAGMENT_MAX_DURATION (4 * CB_FRAGMENT_DURATION)
+
+// Packets older than the memory duration are spilled once they cover at least this interval (in ms).
+#define CB_SPILL_INTERVAL 1000
 
 typedef struct ContinuousBufferStream {
 
     enum AVMediaType type;
     
-    AVFifoBuffer* queue;
+    // Written by the capture thread only, snapshots could be taken concurrently from any thread.
+    PacketRing* queue;
     AVRational time_base;
 
+    // Sequence numbers of the key frames in the queue, accessed by the capture thread only.
+    // Queue always starts from a key frame, so the queue is evicted by whole GOPs.
+    AVFifoBuffer* keyframes;
+
+    // Reusable packet the input packet is retained to before it is moved to the queue.
+    AVPacket* packet;
+
+    // Packets dropped because the ring was full. The rest of the GOP is dropped as well.
+    int64_t nb_dropped;
+    int dropping;
+
+    // Older part of the window, its payloads are in the spill file. NULL unless the spill is enabled.
+    // Spilled packets are always older than the packets in memory.
+    SpillFile* spill;
+    PacketRing* spill_queue;
+
+    // Spill queue sequence numbers of the spilled batches, each batch starts from a key frame.
+    // Accessed by the capture thread only.
+    AVFifoBuffer* spill_batches;
+    AVPacket* spill_packet;
+
     enum AVCodecID codec;
 
     int64_t bit_rate;
@@ -46,38 +107,329 @@ typedef struct ContinuousBufferStream {
     int frame_size;
 
     int64_t duration;
+
+    // Payload bytes currently held by the queue.
+    int64_t size;
+
+    // Parameters of the encoded stream captured at init, used to remux the buffer without reencoding.
+    AVCodecParameters* codecpar;
+
+    // Payload bytes which were stored in the queue and how many of them had to be copied,
+    // the copies to the packet logs included.
+    int64_t bytes_retained;
+    int64_t bytes_copied;
+
+    // Payload bytes written to the spill file.
+    int64_t bytes_spilled;
+
+    // Index of the stream in the packet log.
+    int log_index;
+
+    // Packets missing from the packet logs because they are larger than the log payload area.
+    int64_t nb_log_dropped;
+
+    // Index of the stream in the fragment writer.
+    int fragment_index;
 } ContinuousBufferStream;
 
+/**
+ * Pinned packets of both stream tiers: the spilled packets [first[0], last[0]) followed by the packets
+ * in memory [first[1], last[1]).
+ */
+typedef struct ContinuousBufferView {
+    PacketRing* rings[2];
+    int pins[2];
+    int64_t first[2];
+    int64_t last[2];
+} ContinuousBufferView;
+
+enum ContinuousBufferStage {
+    // Buffering of a packet written to the muxer, including the eviction, logging and fragmenting.
+    CB_STAGE_WRITE_PACKET,
+
+    // Muxing of a snapshot by the flush or the extraction, bytes are known only for the memory output.
+    CB_STAGE_FLUSH,
+
+    CB_NB_STAGES,
+};
+
 typedef struct ContinuousBuffer {
+    const AVClass* class;
+
     ContinuousBufferStream* video;
     ContinuousBufferStream* audio;
 
     int64_t duration;
+
+    // Keep references to the refcounted packets instead of copying their payload.
+    int zero_copy;
+
+    // Allocator of the copied payloads, shared by all the buffers of the process unless set by cb_set_packet_pool.
+    PacketPool* pool;
+    int large_pages;
+
+    // Upper limit of the payload bytes held by all the buffer streams, 0 means no limit.
+    int64_t max_bytes;
+
+    // Process memory usage (private bytes) at which the buffer starts shrinking its window, 0 disables it.
+    int64_t memory_limit;
+
+    // Currently retained window in ms. It equals to duration unless the process is under memory pressure.
+    int64_t window;
+    int64_t memory_checked;
+
+    // Spill file of the tiered mode: only the latest memory_duration (ms) of the window is kept in memory,
+    // the older GOPs are moved to the preallocated file of spill_size bytes.
+    char* spill_file;
+    int64_t spill_size;
+    int64_t memory_duration;
+    SpillFile* spill;
+
+    // Packet log of persist_size bytes every buffered packet is appended to, so the buffer
+    // could be recovered after the process crashed or was restarted.
+    char* persist_file;
+    int64_t persist_size;
+    PacketLog* log;
+
+    // Packet log of shared_size bytes in the named shared memory, other processes read the buffer from it.
+    char* shared_name;
+    int64_t shared_size;
+    PacketLog* shared;
+
+    // Buffer recovered from the log left by the previous process, until it is taken by cb_take_recovered.
+    struct ContinuousBuffer* recovered;
+
+    // Fragmented mode: packets are also muxed to fMP4 fragments as they arrive, so the flush only writes
+    // the cached init segment followed by the fragments. Fragment timestamps are in AV_TIME_BASE.
+    int fragments;
+    FragmentWriter* fragment_writer;
+    PacketRing* fragment_queue;
+    AVPacket* fragment;
+    AVBufferRef* init_segment;
+
+    // Pending fragment starts with a key frame of the leading stream. Fragments which were cut inside a GOP
+    // are queued without AV_PKT_FLAG_KEY, the fragment queue never starts from them.
+    int fragment_independent;
+
+    // Fragments dropped because the readers held the whole fragment queue.
+    int64_t nb_dropped_fragments;
+
+    // Directory of the HLS output, the fragments are its segments and the playlist follows the fragment queue.
+    char* hls_dir;
+    HlsWriter* hls;
+
+    // StageStats of CB_NB_STAGES stages. Snapshots reference it, so the flushes which outlive the buffer
+    // still have a place to record to. NULL for the recovered and attached snapshots.
+    AVBufferRef* stats;
 } ContinuousBuffer;
 
-EXPORT int cb_pop_all_packets_internal(AVFifoBuffer* queue, AVPacket** packets);
+/**
+ * Private data of the demuxer: the snapshot of the buffer which is read and the read position of its streams.
+ * Streams are indexed by the index of the demuxer stream.
+ */
+typedef struct ContinuousBufferDemuxer {
+    ContinuousBuffer* snapshot;
+
+    ContinuousBufferStream* streams[2];
+    ContinuousBufferView views[2];
+    int64_t positions[2];
+} ContinuousBufferDemuxer;
+
+typedef struct ContinuousBufferFlush {
+    ContinuousBuffer* snapshot;
+    char* output;
+
+    // Called on the flush thread once the file is written.
+    void (*callback)(int result, const char* output, void* opaque);
+    void* opaque;
 
-EXPORT int cb_pop_all_packets(ContinuousBuffer* buffer, enum AVMediaType type, AVPacket** packets);
+    HANDLE thread;
+    volatile LONG done;
+    int result;
+} ContinuousBufferFlush;
+
+/**
+ * Memory the buffer is flushed to by cb_write_to_memory. It is reused by the following flushes,
+ * so the grown buffer is not reallocated again.
+ */
+typedef struct ContinuousBufferOutput {
+    // Flushed bytes [0, size).
+    uint8_t* data;
+    int64_t size;
+    int64_t capacity;
+
+    // Caller supplied buffer which never grows, the flush fails if it is too small.
+    int fixed;
+
+    // Write position, muxers seek back to patch the headers.
+    int64_t pos;
+} ContinuousBufferOutput;
+
+/**
+ * Take new references to all the queued packets. The ring is pinned while they are cloned and the packets stay queued,
+ * only the producer evicts them, so this could be called from any thread.
+ * @return Number of the packets, negative value on error.
+ */
+EXPORT int cb_pop_all_packets_internal(PacketRing* queue, AVPacket*** packets);
+
+/**
+ * Take new references to all the buffered packets of the stream, the spilled ones included. The buffer is not drained.
+ */
+EXPORT int cb_pop_all_packets(ContinuousBuffer* buffer, enum AVMediaType type, AVPacket*** packets);
+
+EXPORT ContinuousBuffer* cb_snapshot(ContinuousBuffer* buffer);
+
+EXPORT void cb_free_snapshot(ContinuousBuffer** snapshot);
+
+/**
+ * Take a snapshot of the buffered packets between start and end (ms of the buffer timeline, see cb_get_end_time).
+ * Snapshot starts from the nearest key frame before start. Use AVMEDIA_TYPE_UNKNOWN as type to take all the streams.
+ */
+EXPORT ContinuousBuffer* cb_snapshot_range(ContinuousBuffer* buffer, enum AVMediaType type, int64_t start, int64_t end);
+
+/**
+ * Timestamp (ms) of the latest buffered packet, AV_NOPTS_VALUE if the buffer is empty.
+ */
+EXPORT int64_t cb_get_end_time(ContinuousBuffer* buffer);
 
 EXPORT int cb_write_to_mp4(ContinuousBuffer* buffer, const char* output);
 
+EXPORT int cb_extract_range(ContinuousBuffer* buffer, int64_t start, int64_t end, const char* output);
+
+EXPORT int cb_extract_stream_range(ContinuousBuffer* buffer, enum AVMediaType type, int64_t start, int64_t end, const char* output);
+
+/**
+ * Allocate the flush output. With NULL data the output buffer is allocated and grown by the flush,
+ * otherwise the caller supplied data of the capacity is used.
+ */
+EXPORT ContinuousBufferOutput* cb_output_alloc(uint8_t* data, int64_t capacity);
+
+EXPORT void cb_output_free(ContinuousBufferOutput** output);
+
+/**
+ * Mux the buffer to the output memory, nothing is written to the file system.
+ * @param format Short name of the container (e.g. "mp4", "matroska", "mpegts"), NULL means mp4.
+ */
+EXPORT int cb_write_to_memory(ContinuousBuffer* buffer, const char* format, ContinuousBufferOutput* output);
+
+EXPORT ContinuousBufferFlush* cb_write_to_mp4_async(ContinuousBuffer* buffer, const char* output, void (*callback)(int result, const char* output, void* opaque), void* opaque);
+
+EXPORT int cb_flush_is_done(ContinuousBufferFlush* flush);
+
+EXPORT int cb_flush_wait(ContinuousBufferFlush* flush);
+
+EXPORT void cb_free_flush(ContinuousBufferFlush** flush);
+
 EXPORT AVDictionary* cb_options(int64_t duration);
 
+/**
+ * Use the specified allocator for the copied payloads. Must be called before the muxer is initialized (the header is written),
+ * the pool must outlive the buffer and all its snapshots.
+ */
+EXPORT void cb_set_packet_pool(ContinuousBuffer* buffer, PacketPool* pool);
+
+/**
+ * Recover the buffer from the packet log (see the persist_file option) written by a process which is gone.
+ * @return Snapshot of the logged window which is released by cb_free_snapshot, NULL if there is no valid log.
+ */
+EXPORT ContinuousBuffer* cb_recover(const char* path);
+
+/**
+ * Take over the snapshot which the muxer has recovered at init from the previous packet log of persist_file.
+ * @return Snapshot released by cb_free_snapshot, NULL if nothing was recovered.
+ */
+EXPORT ContinuousBuffer* cb_take_recovered(ContinuousBuffer* buffer);
+
+/**
+ * Take a snapshot of the buffer which is shared (see the shared_name option) by another process.
+ * Packets are copied out of the shared memory, the capture process is never blocked.
+ * @return Snapshot which is released by cb_free_snapshot, NULL if there is no such buffer or it is empty.
+ */
+EXPORT ContinuousBuffer* cb_attach_shared(const char* name);
+
+/**
+ * @return 0 on success, AVERROR(EINVAL) if the buffer has no stats (it is not initialized or it is a recovered snapshot).
+ */
+EXPORT int cb_get_stage_stats(ContinuousBuffer* buffer, enum ContinuousBufferStage stage, StageStatsSummary* summary);
+
+/**
+ * Print the summary of all the stages to stdout.
+ */
+EXPORT void cb_print_stats(ContinuousBuffer* buffer);
+
 static int cb_init(AVFormatContext* avf);
 
 static int cb_write_packet(AVFormatContext* avf, AVPacket* pkt);
 
 static void cb_deinit(AVFormatContext* avf);
 
+/**
+ * Open the demuxer of the buffer. The demuxer reads a snapshot taken when it is opened, packets reference
+ * the buffered payloads, so nothing is copied. The context is closed by avformat_close_input.
+ */
+EXPORT int cb_open_demuxer(AVFormatContext** ctx, ContinuousBuffer* buffer);
+
+static int cb_read_header(AVFormatContext* s);
+
+static int cb_read_packet(AVFormatContext* s, AVPacket* pkt);
+
+static int cb_read_seek(AVFormatContext* s, int stream_index, int64_t timestamp, int flags);
+
+static int cb_read_close(AVFormatContext* s);
+
 #define OFFSET(x) offsetof(ContinuousBuffer, x)
 static const AVOption options[] = {
 
         {"duration", "Buffer duration", OFFSET(duration),
          AV_OPT_TYPE_INT64, {.i64 = 10000}, 0, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM},
-        
+
+        {"zero_copy", "Retain references to the refcounted packets instead of copying them", OFFSET(zero_copy),
+         AV_OPT_TYPE_BOOL, {.i64 = 1}, 0, 1, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"max_bytes", "Maximum amount of payload bytes held by the buffer", OFFSET(max_bytes),
+         AV_OPT_TYPE_INT64, {.i64 = 0}, 0, INT64_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"large_pages", "Allocate the copied payloads from large pages (requires SeLockMemoryPrivilege)", OFFSET(large_pages),
+         AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"spill_file", "Path of the file the older part of the buffer is spilled to", OFFSET(spill_file),
+         AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"spill_size", "Size of the spill file", OFFSET(spill_size),
+         AV_OPT_TYPE_INT64, {.i64 = 1024LL * 1024 * 1024}, 0, INT64_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"memory_duration", "Duration kept in memory when the spill file is used", OFFSET(memory_duration),
+         AV_OPT_TYPE_INT64, {.i64 = 10000}, 0, INT_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"persist_file", "Path of the packet log the buffer is recovered from after a restart", OFFSET(persist_file),
+         AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"persist_size", "Size of the packet log", OFFSET(persist_size),
+         AV_OPT_TYPE_INT64, {.i64 = 256LL * 1024 * 1024}, 0, INT64_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"shared_name", "Name of the shared memory other processes read the buffer from", OFFSET(shared_name),
+         AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"shared_size", "Size of the shared memory", OFFSET(shared_size),
+         AV_OPT_TYPE_INT64, {.i64 = 256LL * 1024 * 1024}, 0, INT64_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"fragments", "Keep the buffer muxed to fMP4 fragments, so the flush does not remux it", OFFSET(fragments),
+         AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"hls_dir", "Directory of the sliding window HLS output of the buffer (enables the fragments)", OFFSET(hls_dir),
+         AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, AV_OPT_FLAG_ENCODING_PARAM},
+
+        {"memory_limit", "Process memory usage at which the buffer window starts shrinking", OFFSET(memory_limit),
+         AV_OPT_TYPE_INT64, {.i64 = 0}, 0, INT64_MAX, AV_OPT_FLAG_ENCODING_PARAM},
+
         {NULL},
 };
 
 EXPORT const AVClass continuous_buffer_muxer_class;
 
-EXPORT const AVOutputFormat continuous_buffer_muxer;
\ No newline at end of file
+EXPORT const AVOutputFormat continuous_buffer_muxer;
+
+/**
+ * Demuxer of the buffer passed as the opaque of the format context, see cb_open_demuxer.
+ */
+EXPORT const AVInputFormat continuous_buffer_demuxer;
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include "fragment-writer.h"
+
+#include <stdio.h>
+
+FragmentWriter* fw_alloc()
+{
+    FragmentWriter* writer = av_mallocz(sizeof(FragmentWriter));
+    if (writer == NULL)
+    {
+        return NULL;
+    }
+
+    writer->start = AV_NOPTS_VALUE;
+    writer->end = AV_NOPTS_VALUE;
+
+    avformat_alloc_output_context2(&writer->muxer, NULL, "mp4", NULL);
+    writer->packet = av_packet_alloc();
+    if (writer->muxer == NULL || writer->packet == NULL || avio_open_dyn_buf(&writer->output) < 0)
+    {
+        fw_free(&writer);
+        return NULL;
+    }
+
+    writer->muxer->pb = writer->output;
+
+    return writer;
+}
+
+void fw_free(FragmentWriter** writer)
+{
+    FragmentWriter* w = *writer;
+    if (w == NULL)
+    {
+        return;
+    }
+
+    // Pending fragment is dropped, so the trailer is not written.
+    avformat_free_context(w->muxer);
+
+    if (w->output != NULL)
+    {
+        uint8_t* data = NULL;
+        avio_close_dyn_buf(w->output, &data);
+        av_free(data);
+    }
+
+    av_buffer_unref(&w->init_segment);
+    av_packet_free(&w->packet);
+    av_freep(writer);
+}
+
+int fw_add_stream(FragmentWriter* writer, const AVCodecParameters* par, AVRational time_base)
+{
+    if (writer->muxer->nb_streams >= FW_MAX_STREAMS)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    AVStream* st = avformat_new_stream(writer->muxer, NULL);
+    if (st == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = avcodec_parameters_copy(st->codecpar, par);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    st->id = st->index;
+    st->codecpar->codec_tag = 0;
+    st->time_base = time_base;
+    writer->time_bases[st->index] = time_base;
+
+    return st->index;
+}
+
+/**
+ * Take the bytes written by the muxer so far and start a new output.
+ */
+static int fw_take_output(FragmentWriter* writer, AVBufferRef** buf)
+{
+    uint8_t* data = NULL;
+    int size = avio_close_dyn_buf(writer->output, &data);
+
+    writer->output = NULL;
+    writer->muxer->pb = NULL;
+
+    *buf = av_buffer_create(data, size, av_buffer_default_free, NULL, 0);
+    if (*buf == NULL)
+    {
+        av_free(data);
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = avio_open_dyn_buf(&writer->output);
+    if (ret < 0)
+    {
+        av_buffer_unref(buf);
+        return ret;
+    }
+
+    writer->muxer->pb = writer->output;
+
+    return 0;
+}
+
+int fw_write_header(FragmentWriter* writer)
+{
+    AVDictionary* opts = NULL;
+
+    // Fragments are cut by the caller only, the empty moov makes the header independent of the samples.
+    av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+
+    int ret = avformat_write_header(writer->muxer, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not write the fragmented MP4 header: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    return fw_take_output(writer, &writer->init_segment);
+}
+
+int fw_write_packet(FragmentWriter* writer, int stream_index, const AVPacket* pkt)
+{
+    int ret = av_packet_ref(writer->packet, pkt);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    AVRational time_base = writer->time_bases[stream_index];
+    int64_t dts = av_rescale_q(pkt->dts, time_base, AV_TIME_BASE_Q);
+    int64_t duration = av_rescale_q(pkt->duration, time_base, AV_TIME_BASE_Q);
+
+    writer->start = writer->nb_packets > 0 ? FFMIN(writer->start, dts) : dts;
+    writer->end = writer->nb_packets > 0 ? FFMAX(writer->end, dts + duration) : dts + duration;
+    writer->nb_packets++;
+
+    av_packet_rescale_ts(writer->packet, time_base, writer->muxer->streams[stream_index]->time_base);
+    writer->packet->stream_index = stream_index;
+    writer->packet->pos = -1;
+
+    ret = av_write_frame(writer->muxer, writer->packet);
+    av_packet_unref(writer->packet);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not mux the packet to the fragment: %s\n", av_err2str(ret));
+    }
+
+    return ret;
+}
+
+int64_t fw_get_pending_duration(FragmentWriter* writer)
+{
+    return writer->nb_packets > 0 ? writer->end - writer->start : 0;
+}
+
+int64_t fw_get_pending_duration_with(FragmentWriter* writer, int stream_index, const AVPacket* pkt)
+{
+    AVRational time_base = writer->time_bases[stream_index];
+    int64_t dts = av_rescale_q(pkt->dts, time_base, AV_TIME_BASE_Q);
+    int64_t end = dts + av_rescale_q(pkt->duration, time_base, AV_TIME_BASE_Q);
+
+    if (writer->nb_packets == 0)
+    {
+        return end - dts;
+    }
+
+    return FFMAX(writer->end, end) - FFMIN(writer->start, dts);
+}
+
+int fw_flush_fragment(FragmentWriter* writer, AVPacket* fragment)
+{
+    if (writer->nb_packets == 0)
+    {
+        return AVERROR(EAGAIN);
+    }
+
+    // With frag_custom the muxer writes the moof and mdat of all the pending samples on the flush request.
+    int ret = av_write_frame(writer->muxer, NULL);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = fw_take_output(writer, &fragment->buf);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    fragment->data = fragment->buf->data;
+    fragment->size = fragment->buf->size;
+    fragment->pts = writer->start;
+    fragment->dts = writer->start;
+    fragment->duration = writer->end - writer->start;
+    fragment->flags = AV_PKT_FLAG_KEY;
+
+    writer->nb_packets = 0;
+
+    return 0;
+}
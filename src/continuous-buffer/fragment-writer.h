@@ -0,0 +1,69 @@
+#pragma once
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include "framework.h"
+
+#define FW_MAX_STREAMS 2
+
+/**
+ * Muxer of the fragmented MP4. Packets are muxed as they arrive and every flushed fragment (moof + mdat)
+ * is handed out as a self-contained byte buffer. The init segment (ftyp + moov) is produced once by the header,
+ * so any run of the fragments appended to it makes a playable file.
+ */
+typedef struct FragmentWriter {
+    AVFormatContext* muxer;
+
+    // Time bases of the source streams, the muxer picks its own ones.
+    AVRational time_bases[FW_MAX_STREAMS];
+
+    // Output of the muxer, it is reopened for every fragment.
+    AVIOContext* output;
+
+    AVBufferRef* init_segment;
+
+    // Reusable packet the source packet is referenced to, the muxer rescales its timestamps.
+    AVPacket* packet;
+
+    // Decoding time (AV_TIME_BASE) of the first and after the last packet of the pending fragment.
+    int64_t start;
+    int64_t end;
+    int nb_packets;
+} FragmentWriter;
+
+EXPORT FragmentWriter* fw_alloc();
+
+EXPORT void fw_free(FragmentWriter** writer);
+
+/**
+ * Add the stream of the encoded packets, must be called before the header is written.
+ * @return Stream index, negative value on error.
+ */
+EXPORT int fw_add_stream(FragmentWriter* writer, const AVCodecParameters* par, AVRational time_base);
+
+/**
+ * Write the header and cache it as the init segment.
+ */
+EXPORT int fw_write_header(FragmentWriter* writer);
+
+/**
+ * Mux the packet to the pending fragment. The packet is not modified, the writer takes a new reference to it.
+ */
+EXPORT int fw_write_packet(FragmentWriter* writer, int stream_index, const AVPacket* pkt);
+
+/**
+ * Duration (AV_TIME_BASE) of the pending fragment.
+ */
+EXPORT int64_t fw_get_pending_duration(FragmentWriter* writer);
+
+/**
+ * Duration (AV_TIME_BASE) the pending fragment would have with the packet.
+ */
+EXPORT int64_t fw_get_pending_duration_with(FragmentWriter* writer, int stream_index, const AVPacket* pkt);
+
+/**
+ * Flush the pending fragment. Fragment bytes are returned as the packet payload, pts and dts are set
+ * to the fragment start and duration to its length (AV_TIME_BASE).
+ * @return 0 on success, AVERROR(EAGAIN) if there is no pending packet.
+ */
+EXPORT int fw_flush_fragment(FragmentWriter* writer, AVPacket* fragment);
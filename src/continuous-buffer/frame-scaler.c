@@ -0,0 +1,316 @@
+#include "frame-scaler.h"
+
+#include <stdio.h>
+
+/**
+ * Pointers to the first row of the band in every plane.
+ */
+static void fs_offset_planes(const AVPixFmtDescriptor* desc, uint8_t* const data[], const int linesize[], int y,
+    uint8_t* planes[4])
+{
+    for (int i = 0; i < 4; i++)
+    {
+        int shift = i == 1 || i == 2 ? desc->log2_chroma_h : 0;
+        planes[i] = data[i] != NULL ? data[i] + (ptrdiff_t)(y >> shift) * linesize[i] : NULL;
+    }
+}
+
+/**
+ * Copy the rows of the band from its scratch frame to the destination.
+ */
+static void fs_copy_band(FrameScaler* scaler, FrameScalerBand* band)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(scaler->dst_format);
+    AVFrame* dst = scaler->dst;
+    AVFrame* scratch = band->scratch;
+
+    for (int i = 0; i < av_pix_fmt_count_planes(scaler->dst_format); i++)
+    {
+        int shift = i == 1 || i == 2 ? desc->log2_chroma_h : 0;
+        int first = band->y >> shift;
+        int last = AV_CEIL_RSHIFT(band->y + band->height, shift);
+
+        av_image_copy_plane(dst->data[i] + (ptrdiff_t)first * dst->linesize[i], dst->linesize[i],
+            scratch->data[i] + (ptrdiff_t)(band->top >> shift) * scratch->linesize[i], scratch->linesize[i],
+            av_image_get_linesize(scaler->dst_format, dst->width, i), last - first);
+    }
+}
+
+static int fs_scale_band(FrameScaler* scaler, FrameScalerBand* band)
+{
+    uint8_t* src[4];
+    fs_offset_planes(av_pix_fmt_desc_get(scaler->src_format), scaler->src->data, scaler->src->linesize, band->y - band->top, src);
+
+    if (band->scratch == NULL)
+    {
+        uint8_t* dst[4];
+        fs_offset_planes(av_pix_fmt_desc_get(scaler->dst_format), scaler->dst->data, scaler->dst->linesize, band->y, dst);
+
+        int ret = sws_scale(band->context, (const uint8_t* const*)src, scaler->src->linesize, 0, band->height,
+            dst, scaler->dst->linesize);
+
+        return ret < 0 ? ret : 0;
+    }
+
+    int ret = sws_scale(band->context, (const uint8_t* const*)src, scaler->src->linesize, 0,
+        band->top + band->height + band->bottom, band->scratch->data, band->scratch->linesize);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    fs_copy_band(scaler, band);
+
+    return 0;
+}
+
+static DWORD WINAPI fs_worker_thread(LPVOID param)
+{
+    FrameScalerWorker* worker = param;
+    FrameScaler* scaler = worker->scaler;
+    int64_t job = 0;
+
+    AcquireSRWLockExclusive(&scaler->lock);
+
+    while (1)
+    {
+        while (!scaler->stop && scaler->job == job)
+        {
+            SleepConditionVariableSRW(&scaler->start, &scaler->lock, INFINITE, 0);
+        }
+
+        if (scaler->stop)
+        {
+            break;
+        }
+
+        job = scaler->job;
+
+        // Frames with fewer bands than the threads leave some workers idle.
+        if (worker->band >= scaler->nb_bands)
+        {
+            continue;
+        }
+
+        FrameScalerBand* band = &scaler->bands[worker->band];
+
+        ReleaseSRWLockExclusive(&scaler->lock);
+        band->result = fs_scale_band(scaler, band);
+        AcquireSRWLockExclusive(&scaler->lock);
+
+        if (--scaler->pending == 0)
+        {
+            WakeConditionVariable(&scaler->done);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&scaler->lock);
+
+    return 0;
+}
+
+FrameScaler* fs_alloc(int nb_threads)
+{
+    FrameScaler* scaler = av_mallocz(sizeof(FrameScaler));
+    if (scaler == NULL)
+    {
+        return NULL;
+    }
+
+    if (nb_threads <= 0)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        nb_threads = info.dwNumberOfProcessors;
+    }
+
+    InitializeSRWLock(&scaler->lock);
+    InitializeConditionVariable(&scaler->start);
+    InitializeConditionVariable(&scaler->done);
+
+    scaler->src_format = AV_PIX_FMT_NONE;
+    scaler->dst_format = AV_PIX_FMT_NONE;
+
+    // The caller scales the first band itself, so it needs one worker less.
+    scaler->nb_threads = 1;
+    nb_threads = FFMIN(nb_threads, FS_MAX_THREADS);
+    for (int i = 1; i < nb_threads; i++)
+    {
+        FrameScalerWorker* worker = &scaler->workers[i];
+        worker->scaler = scaler;
+        worker->band = i;
+        worker->thread = CreateThread(NULL, 0, fs_worker_thread, worker, 0, NULL);
+        if (worker->thread == NULL)
+        {
+            // Fewer workers only make the bands wider.
+            fprintf(stderr, "Could not start the scaler thread.\n");
+            break;
+        }
+
+        scaler->nb_threads++;
+    }
+
+    return scaler;
+}
+
+void fs_free(FrameScaler** scaler)
+{
+    FrameScaler* s = *scaler;
+    if (s == NULL)
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&s->lock);
+    s->stop = 1;
+    WakeAllConditionVariable(&s->start);
+    ReleaseSRWLockExclusive(&s->lock);
+
+    for (int i = 1; i < s->nb_threads; i++)
+    {
+        WaitForSingleObject(s->workers[i].thread, INFINITE);
+        CloseHandle(s->workers[i].thread);
+    }
+
+    for (int i = 0; i < FS_MAX_THREADS; i++)
+    {
+        sws_freeContext(s->bands[i].context);
+        av_frame_free(&s->bands[i].scratch);
+    }
+
+    av_freep(scaler);
+}
+
+/**
+ * Split the frame into the bands and (re)create their scalers.
+ */
+static int fs_configure(FrameScaler* scaler, const AVFrame* src, const AVFrame* dst)
+{
+    if (src->width == scaler->src_width && src->height == scaler->src_height && src->format == scaler->src_format
+        && dst->width == scaler->dst_width && dst->height == scaler->dst_height && dst->format == scaler->dst_format)
+    {
+        return 0;
+    }
+
+    const AVPixFmtDescriptor* src_desc = av_pix_fmt_desc_get(src->format);
+    const AVPixFmtDescriptor* dst_desc = av_pix_fmt_desc_get(dst->format);
+    if (src_desc == NULL || dst_desc == NULL)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    // Palette of the paletted formats is not a plane, such frames are not split.
+    int split = src->height == dst->height && !(src_desc->flags & AV_PIX_FMT_FLAG_PAL)
+        && !(dst_desc->flags & AV_PIX_FMT_FLAG_PAL);
+    int nb_bands = split ? av_clip(src->height / FS_MIN_BAND_HEIGHT, 1, scaler->nb_threads) : 1;
+    int band_height = split ? FFALIGN((src->height + nb_bands - 1) / nb_bands, FS_BAND_ALIGN) : src->height;
+
+    // Chroma which is subsampled differently is filtered across the rows, a band scaled on its own would be clamped
+    // at its edges. Such bands also scale the margin rows of their neighbours and only their own rows are kept.
+    int margin = split && nb_bands > 1 && src_desc->log2_chroma_h != dst_desc->log2_chroma_h ? FS_BAND_MARGIN : 0;
+
+    nb_bands = 0;
+    for (int y = 0; y < src->height; y += band_height)
+    {
+        FrameScalerBand* band = &scaler->bands[nb_bands++];
+        band->y = y;
+        band->height = FFMIN(band_height, src->height - y);
+        band->top = FFMIN(margin, y);
+        band->bottom = FFMIN(margin, src->height - y - band->height);
+
+        int rows = band->top + band->height + band->bottom;
+        band->context = sws_getCachedContext(band->context, src->width, rows, src->format,
+            dst->width, split ? rows : dst->height, dst->format, SWS_BICUBIC, NULL, NULL, NULL);
+        if (band->context == NULL)
+        {
+            fprintf(stderr, "sws_getContext was not initialized\n");
+            scaler->src_format = AV_PIX_FMT_NONE;
+            return AVERROR(EINVAL);
+        }
+
+        av_frame_free(&band->scratch);
+        if (band->top > 0 || band->bottom > 0)
+        {
+            band->scratch = av_frame_alloc();
+            if (band->scratch == NULL)
+            {
+                scaler->src_format = AV_PIX_FMT_NONE;
+                return AVERROR(ENOMEM);
+            }
+
+            band->scratch->format = dst->format;
+            band->scratch->width = dst->width;
+            band->scratch->height = rows;
+            int ret = av_frame_get_buffer(band->scratch, 0);
+            if (ret < 0)
+            {
+                scaler->src_format = AV_PIX_FMT_NONE;
+                return ret;
+            }
+        }
+    }
+
+    for (int i = nb_bands; i < FS_MAX_THREADS; i++)
+    {
+        sws_freeContext(scaler->bands[i].context);
+        scaler->bands[i].context = NULL;
+        av_frame_free(&scaler->bands[i].scratch);
+    }
+
+    // Workers which were idle in the previous job could still be checking the number of bands.
+    AcquireSRWLockExclusive(&scaler->lock);
+    scaler->nb_bands = nb_bands;
+    ReleaseSRWLockExclusive(&scaler->lock);
+
+    scaler->src_width = src->width;
+    scaler->src_height = src->height;
+    scaler->src_format = src->format;
+    scaler->dst_width = dst->width;
+    scaler->dst_height = dst->height;
+    scaler->dst_format = dst->format;
+
+    return 0;
+}
+
+int fs_scale(FrameScaler* scaler, const AVFrame* src, AVFrame* dst)
+{
+    int ret = fs_configure(scaler, src, dst);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    AcquireSRWLockExclusive(&scaler->lock);
+    scaler->src = src;
+    scaler->dst = dst;
+    scaler->pending = scaler->nb_bands - 1;
+    if (scaler->pending > 0)
+    {
+        scaler->job++;
+        WakeAllConditionVariable(&scaler->start);
+    }
+    ReleaseSRWLockExclusive(&scaler->lock);
+
+    scaler->bands[0].result = fs_scale_band(scaler, &scaler->bands[0]);
+
+    // All the bands are written before the frame goes to the encoder.
+    AcquireSRWLockExclusive(&scaler->lock);
+    while (scaler->pending > 0)
+    {
+        SleepConditionVariableSRW(&scaler->done, &scaler->lock, INFINITE, 0);
+    }
+    scaler->src = NULL;
+    scaler->dst = NULL;
+    ReleaseSRWLockExclusive(&scaler->lock);
+
+    for (int i = 0; i < scaler->nb_bands; i++)
+    {
+        if (scaler->bands[i].result < 0)
+        {
+            fprintf(stderr, "sws_scale error: %s\n", av_err2str(scaler->bands[i].result));
+            return scaler->bands[i].result;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+#include "framework.h"
+
+#define FS_MAX_THREADS 16
+
+// Bands are not made thinner than this, smaller frames are not worth the wake-up of the workers.
+#define FS_MIN_BAND_HEIGHT 64
+
+// Band boundaries are aligned to this many rows, so the chroma planes of the subsampled formats split on whole rows.
+#define FS_BAND_ALIGN 16
+
+// Extra source rows scaled on each side of a band whose chroma is filtered vertically. It covers the bicubic filter
+// of a 2x chroma subsampling and keeps the band starts aligned.
+#define FS_BAND_MARGIN 16
+
+/**
+ * Horizontal band of the frame with its own scaler.
+ */
+typedef struct FrameScalerBand {
+    struct SwsContext* context;
+
+    // First row and number of rows, the same in the source and the destination.
+    int y;
+    int height;
+
+    // Margin rows scaled above and below the band, only the band rows are copied from the scratch frame
+    // to the destination. Both are 0 and there is no scratch frame if the band is scaled in place.
+    int top;
+    int bottom;
+    AVFrame* scratch;
+
+    int result;
+} FrameScalerBand;
+
+typedef struct FrameScalerWorker {
+    struct FrameScaler* scaler;
+    HANDLE thread;
+
+    // Band the worker scales, the band 0 is scaled by the caller.
+    int band;
+} FrameScalerWorker;
+
+/**
+ * Pixel format conversion and scaling split into horizontal bands which are scaled in parallel by a worker pool.
+ * Frames which keep their height are split, each band has its own SwsContext and the caller joins all the bands
+ * before fs_scale returns. Vertical scaling needs the rows around the band edges, so these frames are scaled
+ * by a single context on the caller thread. Conversions which change the vertical chroma subsampling
+ * (e.g. BGRA to YUV420P) filter the chroma across the rows even at the same height, so their bands
+ * are scaled with the margin rows of the neighbouring bands and cropped, which leaves no seams.
+ */
+typedef struct FrameScaler {
+    int nb_threads;
+    FrameScalerWorker workers[FS_MAX_THREADS];
+
+    // Geometry and formats the bands are configured for.
+    int src_width;
+    int src_height;
+    enum AVPixelFormat src_format;
+    int dst_width;
+    int dst_height;
+    enum AVPixelFormat dst_format;
+
+    FrameScalerBand bands[FS_MAX_THREADS];
+    int nb_bands;
+
+    // Frames of the current job, valid from the start of the job until all the bands are done.
+    const AVFrame* src;
+    AVFrame* dst;
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE start;
+    CONDITION_VARIABLE done;
+
+    // Incremented for every job, the workers wait for the next one.
+    int64_t job;
+    int pending;
+    int stop;
+} FrameScaler;
+
+/**
+ * Allocate the scaler and start its workers.
+ * @param nb_threads Number of threads including the caller, 0 for the number of the logical processors.
+ */
+EXPORT FrameScaler* fs_alloc(int nb_threads);
+
+/**
+ * Stop the workers and free the scaler.
+ */
+EXPORT void fs_free(FrameScaler** scaler);
+
+/**
+ * Convert the source frame to the size and format of the destination frame, which must be allocated.
+ * The bands are reconfigured only when the geometry or one of the formats changes.
+ * @return Error code (0 if successful)
+ */
+EXPORT int fs_scale(FrameScaler* scaler, const AVFrame* src, AVFrame* dst);
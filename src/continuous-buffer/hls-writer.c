@@ -0,0 +1,339 @@
+#include "hls-writer.h"
+
+#include <stdio.h>
+
+static char* hw_get_segment_path(HlsWriter* writer, int64_t seq)
+{
+    return av_asprintf("%s\\segment-%"PRId64".m4s", writer->dir, seq);
+}
+
+/**
+ * Write the whole file at once.
+ */
+static int hw_write_file(const char* path, const uint8_t* data, int size)
+{
+    HANDLE file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Could not open '%s'.\n", path);
+        return AVERROR(EIO);
+    }
+
+    DWORD written = 0;
+    int ret = WriteFile(file, data, size, &written, NULL) && written == size ? 0 : AVERROR(EIO);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not write '%s'.\n", path);
+    }
+
+    CloseHandle(file);
+
+    return ret;
+}
+
+static int hw_get_nb_segments(AVFifoBuffer* fifo)
+{
+    return av_fifo_size(fifo) / sizeof(HlsSegment);
+}
+
+static HlsSegment hw_peek_segment(AVFifoBuffer* fifo, int index)
+{
+    HlsSegment segment;
+    av_fifo_generic_peek_at(fifo, &segment, index * sizeof(HlsSegment), sizeof(HlsSegment), NULL);
+
+    return segment;
+}
+
+/**
+ * Write the segment file, the fragment reference is released.
+ */
+static void hw_write_segment(HlsWriter* writer, HlsSegment* segment)
+{
+    if (segment->fragment == NULL)
+    {
+        return;
+    }
+
+    char* path = hw_get_segment_path(writer, segment->seq);
+    segment->written = path != NULL && hw_write_file(path, segment->fragment->data, segment->fragment->size) >= 0;
+    av_freep(&path);
+    av_packet_free(&segment->fragment);
+
+    if (segment->written && writer->first < 0)
+    {
+        writer->first = segment->seq;
+    }
+}
+
+/**
+ * Remove the segment files which are out of the playlist for more than HW_REMOVE_DELAY segments.
+ */
+static void hw_remove_segments(HlsWriter* writer, int64_t head)
+{
+    while (writer->first >= 0 && writer->first < head - HW_REMOVE_DELAY)
+    {
+        char* path = hw_get_segment_path(writer, writer->first);
+        if (path == NULL)
+        {
+            return;
+        }
+
+        DeleteFile(path);
+        av_freep(&path);
+
+        writer->first++;
+    }
+}
+
+/**
+ * Replace the playlist with the segments of the playlist FIFO.
+ */
+static int hw_write_playlist(HlsWriter* writer)
+{
+    int nb_segments = hw_get_nb_segments(writer->playlist);
+    if (nb_segments == 0)
+    {
+        return 0;
+    }
+
+    int gaps = 0;
+    int independent = 1;
+    for (int i = 0; i < nb_segments; i++)
+    {
+        HlsSegment segment = hw_peek_segment(writer->playlist, i);
+        gaps |= !segment.written;
+        independent &= segment.independent;
+    }
+
+    char* path = av_asprintf("%s\\%s", writer->dir, HW_PLAYLIST_NAME);
+    char* temp_path = av_asprintf("%s.tmp", path);
+    FILE* f = path != NULL && temp_path != NULL ? fopen(temp_path, "w") : NULL;
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not write the HLS playlist.\n");
+        av_freep(&path);
+        av_freep(&temp_path);
+        return AVERROR(EIO);
+    }
+
+    // Gaps need the version 8. Segments cut inside a long GOP are not independent.
+    fprintf(f, "#EXTM3U\n");
+    fprintf(f, "#EXT-X-VERSION:%d\n", gaps ? 8 : 7);
+    fprintf(f, "#EXT-X-TARGETDURATION:%"PRId64"\n", writer->target_duration);
+    fprintf(f, "#EXT-X-MEDIA-SEQUENCE:%"PRId64"\n", hw_peek_segment(writer->playlist, 0).seq);
+    if (independent)
+    {
+        fprintf(f, "#EXT-X-INDEPENDENT-SEGMENTS\n");
+    }
+    fprintf(f, "#EXT-X-MAP:URI=\"%s\"\n", HW_INIT_SEGMENT_NAME);
+
+    for (int i = 0; i < nb_segments; i++)
+    {
+        HlsSegment segment = hw_peek_segment(writer->playlist, i);
+        fprintf(f, "#EXTINF:%.6f,\n", segment.duration / (double)AV_TIME_BASE);
+        if (!segment.written)
+        {
+            fprintf(f, "#EXT-X-GAP\n");
+        }
+        fprintf(f, "segment-%"PRId64".m4s\n", segment.seq);
+    }
+
+    int ret = ferror(f) ? AVERROR(EIO) : 0;
+    fclose(f);
+
+    // Players never see a partially written playlist.
+    if (ret >= 0 && !MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING))
+    {
+        fprintf(stderr, "Could not replace the HLS playlist '%s'.\n", path);
+        ret = AVERROR(EIO);
+    }
+
+    av_freep(&path);
+    av_freep(&temp_path);
+
+    return ret;
+}
+
+/**
+ * Write the segment and move the playlist window to its head.
+ */
+static void hw_process_segment(HlsWriter* writer, HlsSegment* segment)
+{
+    hw_write_segment(writer, segment);
+
+    while (hw_get_nb_segments(writer->playlist) > 0 && hw_peek_segment(writer->playlist, 0).seq < segment->head)
+    {
+        av_fifo_drain(writer->playlist, sizeof(HlsSegment));
+    }
+
+    if (av_fifo_space(writer->playlist) < sizeof(HlsSegment)
+        && av_fifo_grow(writer->playlist, FFMAX(av_fifo_size(writer->playlist), (int)sizeof(HlsSegment))) < 0)
+    {
+        return;
+    }
+
+    av_fifo_generic_write(writer->playlist, segment, sizeof(HlsSegment), NULL);
+
+    // Output failures are reported, they do not stop the writer.
+    hw_write_playlist(writer);
+    hw_remove_segments(writer, segment->head);
+}
+
+static DWORD WINAPI hw_writer_thread(LPVOID param)
+{
+    HlsWriter* writer = param;
+
+    AcquireSRWLockExclusive(&writer->lock);
+
+    while (1)
+    {
+        while (!writer->stop && hw_get_nb_segments(writer->pending) == 0)
+        {
+            SleepConditionVariableSRW(&writer->wake, &writer->lock, INFINITE, 0);
+        }
+
+        // Segments queued before the stop are still written.
+        if (hw_get_nb_segments(writer->pending) == 0)
+        {
+            break;
+        }
+
+        HlsSegment segment;
+        av_fifo_generic_read(writer->pending, &segment, sizeof(HlsSegment), NULL);
+        if (segment.fragment != NULL)
+        {
+            writer->nb_pending_fragments--;
+        }
+
+        ReleaseSRWLockExclusive(&writer->lock);
+        hw_process_segment(writer, &segment);
+        AcquireSRWLockExclusive(&writer->lock);
+    }
+
+    ReleaseSRWLockExclusive(&writer->lock);
+
+    return 0;
+}
+
+HlsWriter* hw_open(const char* dir, const AVBufferRef* init_segment, int64_t max_duration)
+{
+    if (!CreateDirectory(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        fprintf(stderr, "Could not create the HLS directory '%s'.\n", dir);
+        return NULL;
+    }
+
+    HlsWriter* writer = av_mallocz(sizeof(HlsWriter));
+    if (writer == NULL)
+    {
+        return NULL;
+    }
+
+    InitializeSRWLock(&writer->lock);
+    InitializeConditionVariable(&writer->wake);
+
+    // Target duration is an integer which must not be exceeded by any segment.
+    writer->target_duration = FFMAX((max_duration + AV_TIME_BASE - 1) / AV_TIME_BASE, 1);
+    writer->first = -1;
+    writer->dir = av_strdup(dir);
+    writer->pending = av_fifo_alloc_array(HW_MAX_PENDING, sizeof(HlsSegment));
+    writer->playlist = av_fifo_alloc_array(HW_MAX_PENDING, sizeof(HlsSegment));
+    char* path = av_asprintf("%s\\%s", dir, HW_INIT_SEGMENT_NAME);
+    if (writer->dir == NULL || writer->pending == NULL || writer->playlist == NULL || path == NULL
+        || hw_write_file(path, init_segment->data, init_segment->size) < 0)
+    {
+        av_freep(&path);
+        hw_close(&writer);
+        return NULL;
+    }
+
+    av_freep(&path);
+
+    writer->thread = CreateThread(NULL, 0, hw_writer_thread, writer, 0, NULL);
+    if (writer->thread == NULL)
+    {
+        fprintf(stderr, "Could not start the HLS writer thread.\n");
+        hw_close(&writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+void hw_close(HlsWriter** writer)
+{
+    HlsWriter* w = *writer;
+    if (w == NULL)
+    {
+        return;
+    }
+
+    if (w->thread != NULL)
+    {
+        AcquireSRWLockExclusive(&w->lock);
+        w->stop = 1;
+        WakeConditionVariable(&w->wake);
+        ReleaseSRWLockExclusive(&w->lock);
+
+        WaitForSingleObject(w->thread, INFINITE);
+        CloseHandle(w->thread);
+    }
+
+    if (w->pending != NULL)
+    {
+        while (hw_get_nb_segments(w->pending) > 0)
+        {
+            HlsSegment segment;
+            av_fifo_generic_read(w->pending, &segment, sizeof(HlsSegment), NULL);
+            av_packet_free(&segment.fragment);
+        }
+
+        av_fifo_freep(&w->pending);
+    }
+
+    av_fifo_freep(&w->playlist);
+    av_freep(&w->dir);
+    av_freep(writer);
+}
+
+int hw_add_segment(HlsWriter* writer, int64_t seq, const AVPacket* fragment, int64_t head)
+{
+    HlsSegment segment = { 0 };
+    segment.seq = seq;
+    segment.duration = fragment->duration;
+    segment.head = head;
+    segment.independent = (fragment->flags & AV_PKT_FLAG_KEY) != 0;
+
+    AcquireSRWLockExclusive(&writer->lock);
+
+    int ret = 0;
+    if (av_fifo_space(writer->pending) < sizeof(HlsSegment)
+        && av_fifo_grow(writer->pending, FFMAX(av_fifo_size(writer->pending), (int)sizeof(HlsSegment))) < 0)
+    {
+        ret = AVERROR(ENOMEM);
+    }
+    else
+    {
+        // Segment which is dropped still keeps its place in the playlist, as a gap.
+        if (writer->nb_pending_fragments < HW_MAX_PENDING)
+        {
+            segment.fragment = av_packet_clone(fragment);
+        }
+
+        if (segment.fragment != NULL)
+        {
+            writer->nb_pending_fragments++;
+        }
+        else
+        {
+            writer->nb_dropped++;
+        }
+
+        av_fifo_generic_write(writer->pending, &segment, sizeof(HlsSegment), NULL);
+        WakeConditionVariable(&writer->wake);
+    }
+
+    ReleaseSRWLockExclusive(&writer->lock);
+
+    return ret;
+}
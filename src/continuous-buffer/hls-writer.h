@@ -0,0 +1,81 @@
+#pragma once
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/fifo.h>
+#include "framework.h"
+
+#define HW_PLAYLIST_NAME "index.m3u8"
+#define HW_INIT_SEGMENT_NAME "init.mp4"
+
+// Segments which dropped out of the playlist are removed with this delay (in segments),
+// so the players which loaded the previous playlist could still fetch them.
+#define HW_REMOVE_DELAY 3
+
+// Fragments which could wait for the writer thread. Beyond that the disk is stalled and the new segments are dropped.
+#define HW_MAX_PENDING 32
+
+typedef struct HlsSegment {
+    int64_t seq;
+    int64_t duration;
+
+    // Head of the fragment queue once the segment was added, the older segments leave the playlist.
+    int64_t head;
+
+    // Reference to the fragment until its file is written, NULL if it was dropped.
+    AVPacket* fragment;
+
+    // Segment file was written, otherwise the playlist marks the segment as a gap.
+    int written;
+
+    // Segment starts with a key frame.
+    int independent;
+} HlsSegment;
+
+/**
+ * Sliding window HLS output in a directory. Segments are the fMP4 fragments of the buffer, each one is written
+ * once when it is completed, and the playlist lists exactly the fragments of the fragment queue.
+ *
+ * The capture thread only queues the fragment references, the files are written, replaced and removed
+ * by the writer thread, so a stalled disk never stops the capture.
+ */
+typedef struct HlsWriter {
+    char* dir;
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE wake;
+    HANDLE thread;
+    int stop;
+
+    // Segments queued by the capture thread, guarded by the lock.
+    AVFifoBuffer* pending;
+    int nb_pending_fragments;
+
+    // Segments dropped because too many fragments were waiting for the disk.
+    int64_t nb_dropped;
+
+    // Segments of the current playlist, accessed by the writer thread only.
+    AVFifoBuffer* playlist;
+
+    // Sequence number of the oldest segment file which is not removed yet.
+    int64_t first;
+
+    // Target duration (in seconds) of the playlist, a live playlist must never change it.
+    int64_t target_duration;
+} HlsWriter;
+
+/**
+ * Create the directory (if needed), write the init segment to it and start the writer thread.
+ * @param max_duration Longest segment (AV_TIME_BASE) the caller could add, it fixes the target duration.
+ */
+EXPORT HlsWriter* hw_open(const char* dir, const AVBufferRef* init_segment, int64_t max_duration);
+
+/**
+ * Stop the writer once the queued segments are written, the written files are kept.
+ */
+EXPORT void hw_close(HlsWriter** writer);
+
+/**
+ * Queue the fragment with the specified sequence number as the next segment, the writer takes a new reference to it.
+ * The playlist is updated to the fragments [head, seq]. Never waits for the disk.
+ */
+EXPORT int hw_add_segment(HlsWriter* writer, int64_t seq, const AVPacket* fragment, int64_t head);
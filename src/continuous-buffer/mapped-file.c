@@ -0,0 +1,178 @@
+#include "mapped-file.h"
+
+#include <stdio.h>
+
+MappedFile* mf_open(const char* path, int64_t size, int flags)
+{
+    MappedFile* file = av_mallocz(sizeof(MappedFile));
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    file->size = size;
+
+    file->file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        flags & MF_FLAG_KEEP ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Could not open '%s'\n", path);
+        av_freep(&file);
+        return NULL;
+    }
+
+    LARGE_INTEGER current_size = { 0 };
+    if (!GetFileSizeEx(file->file, &current_size))
+    {
+        current_size.QuadPart = 0;
+    }
+
+    // Existing file could be mapped as is, without knowing its size in advance.
+    if (size == 0 && (flags & MF_FLAG_KEEP))
+    {
+        size = file->size = current_size.QuadPart;
+    }
+
+    if (size <= 0)
+    {
+        fprintf(stderr, "Could not map an empty file '%s'\n", path);
+        mf_close(&file);
+        return NULL;
+    }
+
+    // File is preallocated at once, so the mapped writes never extend it.
+    if (current_size.QuadPart != size)
+    {
+        LARGE_INTEGER end = { 0 };
+        end.QuadPart = size;
+        if (!SetFilePointerEx(file->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file->file))
+        {
+            fprintf(stderr, "Could not allocate %"PRId64" bytes for '%s'\n", size, path);
+            mf_close(&file);
+            return NULL;
+        }
+
+        file->created = 1;
+    }
+    else if (!(flags & MF_FLAG_KEEP))
+    {
+        file->created = 1;
+    }
+
+    file->mapping = CreateFileMapping(file->file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (file->mapping != NULL)
+    {
+        file->data = MapViewOfFile(file->mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+    }
+
+    if (file->data == NULL)
+    {
+        fprintf(stderr, "Could not map '%s'\n", path);
+        mf_close(&file);
+        return NULL;
+    }
+
+    return file;
+}
+
+MappedFile* mf_open_shared(const char* name, int64_t size)
+{
+    MappedFile* file = av_mallocz(sizeof(MappedFile));
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    file->file = INVALID_HANDLE_VALUE;
+    file->size = size;
+    file->created = 1;
+
+    file->mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+    int exists = file->mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS;
+
+    // Existing memory keeps its original size, so the whole of it is mapped.
+    if (file->mapping != NULL)
+    {
+        file->data = MapViewOfFile(file->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    }
+
+    if (file->data == NULL)
+    {
+        fprintf(stderr, "Could not create the shared memory '%s'\n", name);
+        mf_close(&file);
+        return NULL;
+    }
+
+    if (exists)
+    {
+        // The memory is still held by the readers of a writer which is gone (e.g. a worker process outlived
+        // the restarted capture). It is reused, its content is reinitialized by the caller.
+        MEMORY_BASIC_INFORMATION info;
+        if (VirtualQuery(file->data, &info, sizeof(info)) == 0 || (int64_t)info.RegionSize < size)
+        {
+            fprintf(stderr, "Shared memory '%s' already exists and it is smaller than %"PRId64" bytes\n", name, size);
+            mf_close(&file);
+            return NULL;
+        }
+
+        file->created = 0;
+    }
+
+    return file;
+}
+
+MappedFile* mf_attach_shared(const char* name)
+{
+    MappedFile* file = av_mallocz(sizeof(MappedFile));
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    file->file = INVALID_HANDLE_VALUE;
+
+    file->mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+    if (file->mapping != NULL)
+    {
+        file->data = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    // Size of the view is the size of the mapping rounded up to the page size.
+    MEMORY_BASIC_INFORMATION info;
+    if (file->data == NULL || VirtualQuery(file->data, &info, sizeof(info)) == 0)
+    {
+        fprintf(stderr, "Could not attach to the shared memory '%s'\n", name);
+        mf_close(&file);
+        return NULL;
+    }
+
+    file->size = info.RegionSize;
+
+    return file;
+}
+
+void mf_close(MappedFile** file)
+{
+    MappedFile* f = *file;
+    if (f == NULL)
+    {
+        return;
+    }
+
+    if (f->data != NULL)
+    {
+        UnmapViewOfFile(f->data);
+    }
+
+    if (f->mapping != NULL)
+    {
+        CloseHandle(f->mapping);
+    }
+
+    if (f->file != NULL && f->file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(f->file);
+    }
+
+    av_freep(file);
+}
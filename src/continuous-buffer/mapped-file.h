@@ -0,0 +1,39 @@
+#pragma once
+
+#include <libavutil/avutil.h>
+#include "framework.h"
+
+// Keep the content of an existing file instead of truncating it.
+#define MF_FLAG_KEEP 1
+
+/**
+ * File which is preallocated to a fixed size and mapped to the memory as a whole.
+ */
+typedef struct MappedFile {
+    HANDLE file;
+    HANDLE mapping;
+
+    uint8_t* data;
+    int64_t size;
+
+    // The file did not exist (or had a different size) and its content is zeroed.
+    int created;
+} MappedFile;
+
+/**
+ * Create the named shared memory (backed by the paging file) which other processes could attach to.
+ * Memory which still exists (held by the readers of a previous writer) is reused with its content, created is 0 then.
+ */
+EXPORT MappedFile* mf_open_shared(const char* name, int64_t size);
+
+/**
+ * Map the named shared memory created by another process for reading only.
+ */
+EXPORT MappedFile* mf_attach_shared(const char* name);
+
+/**
+ * Open the file and map it. Size 0 with MF_FLAG_KEEP maps an existing file with its current size.
+ */
+EXPORT MappedFile* mf_open(const char* path, int64_t size, int flags);
+
+EXPORT void mf_close(MappedFile** file);
@@ -0,0 +1,430 @@
+#include "packet-log.h"
+
+#include <stdio.h>
+
+static PacketLog* pl_map(MappedFile* file)
+{
+    PacketLog* log = av_mallocz(sizeof(PacketLog));
+    if (log == NULL)
+    {
+        mf_close(&file);
+        return NULL;
+    }
+
+    log->file = file;
+    log->header = (PacketLogHeader*)file->data;
+    log->index = (PacketLogEntry*)(file->data + PL_HEADER_SIZE);
+
+    return log;
+}
+
+static int64_t pl_get_payload_size(int64_t size, int64_t index_capacity)
+{
+    // Padding after the payload area keeps the reads of the decoders inside the mapping.
+    int64_t payload_size = size - PL_HEADER_SIZE - index_capacity * (int64_t)sizeof(PacketLogEntry)
+        - AV_INPUT_BUFFER_PADDING_SIZE;
+    if (payload_size <= 0)
+    {
+        fprintf(stderr, "Packet log size is too small for %"PRId64" entries.\n", index_capacity);
+    }
+
+    return payload_size;
+}
+
+/**
+ * Initialize the header of the new log in the mapped file.
+ * @param start Sequence number of the first packet.
+ */
+static PacketLog* pl_init(MappedFile* file, int64_t payload_size, int64_t index_capacity, int64_t duration, int64_t start)
+{
+    PacketLog* log = pl_map(file);
+    if (log == NULL)
+    {
+        return NULL;
+    }
+
+    log->payload = (uint8_t*)(log->index + index_capacity);
+
+    memset(log->header, 0, sizeof(PacketLogHeader));
+    log->header->version = PL_VERSION;
+    log->header->index_capacity = index_capacity;
+    log->header->payload_size = payload_size;
+    log->header->duration = duration;
+    log->header->head = start;
+    log->header->tail = start;
+
+    // Magic is written the last, so a half initialized header is never attached.
+    InterlockedExchange((volatile LONG*)&log->header->magic, PL_MAGIC);
+
+    return log;
+}
+
+PacketLog* pl_create(const char* path, int64_t size, int64_t index_capacity, int64_t duration)
+{
+    int64_t payload_size = pl_get_payload_size(size, index_capacity);
+    if (payload_size <= 0)
+    {
+        return NULL;
+    }
+
+    MappedFile* file = mf_open(path, size, 0);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    return pl_init(file, payload_size, index_capacity, duration, 0);
+}
+
+PacketLog* pl_create_shared(const char* name, int64_t size, int64_t index_capacity, int64_t duration)
+{
+    int64_t payload_size = pl_get_payload_size(size, index_capacity);
+    if (payload_size <= 0)
+    {
+        return NULL;
+    }
+
+    MappedFile* file = mf_open_shared(name, size);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    // Readers of the previous log could still be copying out of the reused memory. Sequence numbers continue
+    // after its last packet, so such copies fail the head check instead of passing the packets of the new log.
+    int64_t start = 0;
+    PacketLogHeader* previous = (PacketLogHeader*)file->data;
+    if (!file->created && previous->magic == PL_MAGIC && previous->tail > 0)
+    {
+        start = previous->tail;
+    }
+
+    return pl_init(file, payload_size, index_capacity, duration, start);
+}
+
+static void pl_unmap(void* opaque, uint8_t* data)
+{
+    MappedFile* file = opaque;
+    mf_close(&file);
+}
+
+/**
+ * Check the header of the existing log.
+ */
+static PacketLog* pl_validate(MappedFile* file, const char* path)
+{
+    PacketLogHeader* header = (PacketLogHeader*)file->data;
+    if (file->size < PL_HEADER_SIZE
+        || header->magic != PL_MAGIC
+        || header->version != PL_VERSION
+        || header->index_capacity <= 0 || header->index_capacity > file->size / (int64_t)sizeof(PacketLogEntry)
+        || header->payload_size <= 0 || header->payload_size > file->size
+        || header->nb_streams < 0 || header->nb_streams > PL_MAX_STREAMS
+        || PL_HEADER_SIZE + header->index_capacity * (int64_t)sizeof(PacketLogEntry) + header->payload_size
+            + AV_INPUT_BUFFER_PADDING_SIZE > file->size
+        || header->head > header->tail
+        || header->tail - header->head > header->index_capacity)
+    {
+        fprintf(stderr, "'%s' is not a valid packet log.\n", path);
+        mf_close(&file);
+        return NULL;
+    }
+
+    PacketLog* log = pl_map(file);
+    if (log == NULL)
+    {
+        return NULL;
+    }
+
+    log->payload = (uint8_t*)(log->index + header->index_capacity);
+
+    return log;
+}
+
+PacketLog* pl_attach(const char* path)
+{
+    if (GetFileAttributes(path) == INVALID_FILE_ATTRIBUTES)
+    {
+        return NULL;
+    }
+
+    MappedFile* file = mf_open(path, 0, MF_FLAG_KEEP);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    PacketLog* log = pl_validate(file, path);
+    if (log == NULL)
+    {
+        return NULL;
+    }
+
+    // The mapping is released with the last packet which references it.
+    log->mapping = av_buffer_create(file->data, (int)FFMIN(file->size, INT_MAX), pl_unmap, file, 0);
+    if (log->mapping == NULL)
+    {
+        pl_close(&log);
+        return NULL;
+    }
+
+    return log;
+}
+
+PacketLog* pl_attach_shared(const char* name)
+{
+    MappedFile* file = mf_attach_shared(name);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    PacketLog* log = pl_validate(file, name);
+    if (log != NULL)
+    {
+        log->live = 1;
+    }
+
+    return log;
+}
+
+void pl_close(PacketLog** log)
+{
+    PacketLog* l = *log;
+    if (l == NULL)
+    {
+        return;
+    }
+
+    if (l->mapping != NULL)
+    {
+        av_buffer_unref(&l->mapping);
+    }
+    else
+    {
+        mf_close(&l->file);
+    }
+
+    av_freep(log);
+}
+
+int pl_add_stream(PacketLog* log, const AVCodecParameters* par, AVRational time_base)
+{
+    PacketLogHeader* header = log->header;
+    if (header->nb_streams >= PL_MAX_STREAMS || par->extradata_size > PL_MAX_EXTRADATA)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    PacketLogStream* stream = &header->streams[header->nb_streams];
+    stream->codec_type = par->codec_type;
+    stream->codec_id = par->codec_id;
+    stream->bit_rate = par->bit_rate;
+    stream->format = par->format;
+    stream->width = par->width;
+    stream->height = par->height;
+    stream->sample_rate = par->sample_rate;
+    stream->channels = par->channels;
+    stream->frame_size = par->frame_size;
+    stream->channel_layout = par->channel_layout;
+    stream->time_base_num = time_base.num;
+    stream->time_base_den = time_base.den;
+    stream->extradata_size = par->extradata_size;
+    if (par->extradata_size > 0)
+    {
+        memcpy(stream->extradata, par->extradata, par->extradata_size);
+    }
+
+    return header->nb_streams++;
+}
+
+/**
+ * Find the payload offset for the packet, the oldest entries are evicted until it fits.
+ */
+static int64_t pl_find_space(PacketLog* log, int64_t size)
+{
+    PacketLogHeader* header = log->header;
+
+    while (header->tail > header->head)
+    {
+        int64_t oldest = log->index[header->head % header->index_capacity].offset;
+
+        if (header->tail - header->head < header->index_capacity)
+        {
+            // Payloads are never split, the end of the area is skipped if the packet does not fit there.
+            if (header->write > oldest)
+            {
+                if (header->payload_size - header->write >= size)
+                {
+                    return header->write;
+                }
+
+                if (oldest >= size)
+                {
+                    return 0;
+                }
+            }
+            else if (oldest - header->write >= size)
+            {
+                return header->write;
+            }
+        }
+
+        // The head must be moved before the space is reused, otherwise a crash leaves a corrupted entry in the log.
+        // Full barrier: the readers of a live log must see the head before the entry is overwritten.
+        InterlockedExchange64(&header->head, header->head + 1);
+    }
+
+    return 0;
+}
+
+int pl_append(PacketLog* log, int stream_index, const AVPacket* pkt)
+{
+    PacketLogHeader* header = log->header;
+    if (pkt->size > header->payload_size)
+    {
+        return AVERROR(ENOSPC);
+    }
+
+    if (pkt->size <= 0)
+    {
+        return 0;
+    }
+
+    int64_t offset = pl_find_space(log, pkt->size);
+
+    PacketLogEntry* entry = &log->index[header->tail % header->index_capacity];
+    entry->offset = offset;
+    entry->pts = pkt->pts;
+    entry->dts = pkt->dts;
+    entry->duration = pkt->duration;
+    entry->size = pkt->size;
+    entry->flags = pkt->flags;
+    entry->stream_index = stream_index;
+
+    memcpy(log->payload + offset, pkt->data, pkt->size);
+    header->write = offset + pkt->size;
+
+    // Publish the entry once it is complete.
+    WriteRelease64(&header->tail, header->tail + 1);
+
+    return 0;
+}
+
+int pl_get_stream_parameters(PacketLog* log, int stream_index, AVCodecParameters* par, AVRational* time_base)
+{
+    if (stream_index < 0 || stream_index >= log->header->nb_streams)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    PacketLogStream* stream = &log->header->streams[stream_index];
+    if (stream->extradata_size < 0 || stream->extradata_size > PL_MAX_EXTRADATA)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    par->codec_type = stream->codec_type;
+    par->codec_id = stream->codec_id;
+    par->bit_rate = stream->bit_rate;
+    par->format = stream->format;
+    par->width = stream->width;
+    par->height = stream->height;
+    par->sample_rate = stream->sample_rate;
+    par->channels = stream->channels;
+    par->frame_size = stream->frame_size;
+    par->channel_layout = stream->channel_layout;
+
+    av_freep(&par->extradata);
+    par->extradata_size = 0;
+    if (stream->extradata_size > 0)
+    {
+        par->extradata = av_mallocz(stream->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (par->extradata == NULL)
+        {
+            return AVERROR(ENOMEM);
+        }
+
+        memcpy(par->extradata, stream->extradata, stream->extradata_size);
+        par->extradata_size = stream->extradata_size;
+    }
+
+    *time_base = (AVRational){ stream->time_base_num, stream->time_base_den };
+
+    return 0;
+}
+
+/**
+ * Copy the packet of the live log. The writer moves the head before it reuses the space of an entry, so the copy
+ * is valid only if the entry is still not older than the head once it is done.
+ */
+static int pl_copy_packet(PacketLog* log, int64_t seq, AVPacket* pkt)
+{
+    PacketLogHeader* header = log->header;
+    if (seq < ReadAcquire64(&header->head) || seq >= ReadAcquire64(&header->tail))
+    {
+        return AVERROR(ENOENT);
+    }
+
+    PacketLogEntry entry = log->index[seq % header->index_capacity];
+    if (entry.size <= 0 || entry.offset < 0 || entry.offset + entry.size > header->payload_size
+        || entry.stream_index < 0 || entry.stream_index >= header->nb_streams)
+    {
+        return AVERROR(ENOENT);
+    }
+
+    int ret = av_new_packet(pkt, entry.size);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    memcpy(pkt->data, log->payload + entry.offset, entry.size);
+
+    // The copy must be complete before the head is checked.
+    MemoryBarrier();
+    if (seq < ReadAcquire64(&header->head))
+    {
+        av_packet_unref(pkt);
+        return AVERROR(ENOENT);
+    }
+
+    pkt->pts = entry.pts;
+    pkt->dts = entry.dts;
+    pkt->duration = entry.duration;
+    pkt->flags = entry.flags;
+    pkt->stream_index = entry.stream_index;
+
+    return 0;
+}
+
+int pl_read_packet(PacketLog* log, int64_t seq, AVPacket* pkt)
+{
+    if (log->live)
+    {
+        return pl_copy_packet(log, seq, pkt);
+    }
+
+    PacketLogEntry* entry = &log->index[seq % log->header->index_capacity];
+    if (entry->size <= 0 || entry->offset < 0 || entry->offset + entry->size > log->header->payload_size
+        || entry->stream_index < 0 || entry->stream_index >= log->header->nb_streams)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    pkt->buf = av_buffer_ref(log->mapping);
+    if (pkt->buf == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    pkt->data = log->payload + entry->offset;
+    pkt->size = entry->size;
+    pkt->pts = entry->pts;
+    pkt->dts = entry->dts;
+    pkt->duration = entry->duration;
+    pkt->flags = entry->flags;
+    pkt->stream_index = entry->stream_index;
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <libavcodec/avcodec.h>
+#include "framework.h"
+#include "mapped-file.h"
+
+#define PL_MAGIC MKTAG('C', 'B', 'P', 'L')
+#define PL_VERSION 1
+
+#define PL_MAX_STREAMS 2
+#define PL_MAX_EXTRADATA 16384
+
+// Header with the stream parameters, the index follows it.
+#define PL_HEADER_SIZE 65536
+
+typedef struct PacketLogStream {
+    int32_t codec_type;
+    int32_t codec_id;
+    int64_t bit_rate;
+    int32_t format;
+    int32_t width;
+    int32_t height;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t frame_size;
+    uint64_t channel_layout;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t extradata_size;
+    uint8_t extradata[PL_MAX_EXTRADATA];
+} PacketLogStream;
+
+typedef struct PacketLogEntry {
+    // Offset of the payload from the start of the payload area.
+    int64_t offset;
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int32_t size;
+    int32_t flags;
+    int32_t stream_index;
+    int32_t reserved;
+} PacketLogEntry;
+
+/**
+ * Header of the log file. Entries [head, tail) are complete. An entry and its payload are written before
+ * the tail is moved past it, and the head is moved before the space of the oldest entries is reused,
+ * so the header is consistent at any moment the process could die.
+ */
+typedef struct PacketLogHeader {
+    uint32_t magic;
+    uint32_t version;
+    int64_t index_capacity;
+    int64_t payload_size;
+    int64_t duration;
+    int32_t nb_streams;
+    int32_t reserved;
+
+    volatile LONG64 head;
+    volatile LONG64 tail;
+
+    // Offset of the next payload.
+    int64_t write;
+
+    PacketLogStream streams[PL_MAX_STREAMS];
+} PacketLogHeader;
+
+/**
+ * Packet log in a memory mapped file: the header, the ring of the entries and the ring of the payloads.
+ *
+ * Log is written through the mapping and never flushed explicitly. The pages belong to the system file cache,
+ * so the log survives a crash or restart of the process (but not of the system) without any fsync.
+ */
+typedef struct PacketLog {
+    MappedFile* file;
+
+    PacketLogHeader* header;
+    PacketLogEntry* index;
+    uint8_t* payload;
+
+    // Reference to the whole mapping of an attached log, packets read from the log hold it.
+    AVBufferRef* mapping;
+
+    // Attached to the shared log which is still written by another process.
+    int live;
+} PacketLog;
+
+/**
+ * Create an empty log, an existing file is overwritten.
+ * @param duration Duration (ms) which should be recovered from the log.
+ */
+EXPORT PacketLog* pl_create(const char* path, int64_t size, int64_t index_capacity, int64_t duration);
+
+/**
+ * Create an empty log in the named shared memory, so the processes which attach to it could read the packets
+ * while they are being written.
+ */
+EXPORT PacketLog* pl_create_shared(const char* name, int64_t size, int64_t index_capacity, int64_t duration);
+
+/**
+ * Attach to the shared log for reading only. Packets are copied out of the shared memory, as the writer
+ * could reuse it at any moment.
+ */
+EXPORT PacketLog* pl_attach_shared(const char* name);
+
+/**
+ * Attach to the log which was written by another (probably crashed) process.
+ * @return Log or NULL if the file does not exist or it is not a valid log.
+ */
+EXPORT PacketLog* pl_attach(const char* path);
+
+/**
+ * Release the log. Packets read from an attached log keep its file mapped until they are freed.
+ */
+EXPORT void pl_close(PacketLog** log);
+
+/**
+ * Add the stream to the log, must be called before any packet is appended.
+ * @return Log stream index, negative value on error.
+ */
+EXPORT int pl_add_stream(PacketLog* log, const AVCodecParameters* par, AVRational time_base);
+
+/**
+ * Append the packet, the oldest packets are overwritten if there is no space left.
+ * @return 0 on success, AVERROR(ENOSPC) if the packet is larger than the whole payload area.
+ */
+EXPORT int pl_append(PacketLog* log, int stream_index, const AVPacket* pkt);
+
+EXPORT int pl_get_stream_parameters(PacketLog* log, int stream_index, AVCodecParameters* par, AVRational* time_base);
+
+/**
+ * Read the packet of the attached log, the packet payload references the file mapping.
+ * Packets of a live log are copied.
+ * @return 0 on success, AVERROR(ENOENT) if the packet has been already overwritten by the writer.
+ */
+EXPORT int pl_read_packet(PacketLog* log, int64_t seq, AVPacket* pkt);
@@ -0,0 +1,236 @@
+#include "packet-pool.h"
+
+static INIT_ONCE pp_shared_once[2] = { INIT_ONCE_STATIC_INIT, INIT_ONCE_STATIC_INIT };
+
+PacketPool* pp_alloc(int flags)
+{
+    PacketPool* pool = av_mallocz(sizeof(PacketPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->flags = flags;
+
+    for (int i = 0; i < PP_NB_CLASSES; i++)
+    {
+        pool->classes[i].size = 1 << (PP_MIN_CLASS_BITS + i);
+        InitializeSRWLock(&pool->classes[i].lock);
+    }
+
+    return pool;
+}
+
+void pp_free(PacketPool** pool)
+{
+    PacketPool* p = *pool;
+    if (p == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < PP_NB_CLASSES; i++)
+    {
+        PacketPoolClass* c = &p->classes[i];
+
+        // Released references still own their AVBuffer structs, the chunks themselves belong to the slabs.
+        while (c->free_refs != NULL)
+        {
+            AVBufferRef* ref = c->free_refs;
+            c->free_refs = *(AVBufferRef**)ref->data;
+            av_buffer_unref(&ref);
+        }
+
+        while (c->slabs != NULL)
+        {
+            uint8_t* slab = c->slabs;
+            c->slabs = *(uint8_t**)slab;
+            VirtualFree(slab, 0, MEM_RELEASE);
+        }
+    }
+
+    av_freep(pool);
+}
+
+static BOOL CALLBACK pp_init_shared(PINIT_ONCE once, PVOID flags, PVOID* context)
+{
+    *context = pp_alloc((int)(intptr_t)flags);
+
+    return *context != NULL;
+}
+
+PacketPool* pp_get_shared(int flags)
+{
+    PVOID pool = NULL;
+    int index = flags & PP_FLAG_LARGE_PAGES ? 1 : 0;
+
+    if (!InitOnceExecuteOnce(&pp_shared_once[index], pp_init_shared, (PVOID)(intptr_t)flags, &pool))
+    {
+        return NULL;
+    }
+
+    return pool;
+}
+
+/**
+ * Index of the smallest size class which fits the size.
+ */
+static int pp_get_class(int size)
+{
+    if (size <= 1 << PP_MIN_CLASS_BITS)
+    {
+        return 0;
+    }
+
+    return av_log2(size - 1) + 1 - PP_MIN_CLASS_BITS;
+}
+
+/**
+ * Size class of the pool the buffer was allocated from, or NULL if the buffer does not belong to the pool.
+ */
+static PacketPoolClass* pp_get_owner(PacketPool* pool, AVBufferRef* buf)
+{
+    if (pool == NULL || buf->size < 1 << PP_MIN_CLASS_BITS || buf->size > 1 << PP_MAX_CLASS_BITS)
+    {
+        return NULL;
+    }
+
+    PacketPoolClass* c = &pool->classes[pp_get_class(buf->size)];
+
+    return av_buffer_get_opaque(buf) == c ? c : NULL;
+}
+
+/**
+ * Called by FFmpeg once the last reference to the chunk is gone.
+ */
+static void pp_release_chunk(void* opaque, uint8_t* data)
+{
+    PacketPoolClass* c = opaque;
+
+    AcquireSRWLockExclusive(&c->lock);
+    *(uint8_t**)data = c->free_chunks;
+    c->free_chunks = data;
+    ReleaseSRWLockExclusive(&c->lock);
+}
+
+/**
+ * Allocate a new slab for the size class. Must be called under the class lock.
+ */
+static int pp_alloc_slab(PacketPool* pool, PacketPoolClass* c)
+{
+    SIZE_T size = PP_SLAB_HEADER_SIZE + (SIZE_T)FFMAX(PP_SLAB_SIZE / c->size, 1) * c->size;
+    uint8_t* slab = NULL;
+
+    if (pool->flags & PP_FLAG_LARGE_PAGES)
+    {
+        SIZE_T large_page = GetLargePageMinimum();
+        if (large_page > 0)
+        {
+            slab = VirtualAlloc(NULL, FFALIGN(size, large_page), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (slab != NULL)
+            {
+                size = FFALIGN(size, large_page);
+            }
+        }
+    }
+
+    // Large pages are not available without the privilege, so the pool falls back to the regular pages.
+    if (slab == NULL)
+    {
+        slab = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    if (slab == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    *(uint8_t**)slab = c->slabs;
+    c->slabs = slab;
+    c->slab_next = slab + PP_SLAB_HEADER_SIZE;
+    c->slab_end = slab + size;
+
+    InterlockedIncrement64(&pool->nb_allocations);
+
+    return 0;
+}
+
+AVBufferRef* pp_get_buffer(PacketPool* pool, int size)
+{
+    if (size > 1 << PP_MAX_CLASS_BITS)
+    {
+        InterlockedIncrement64(&pool->nb_allocations);
+        return av_buffer_alloc(size);
+    }
+
+    PacketPoolClass* c = &pool->classes[pp_get_class(size)];
+    AVBufferRef* buf = NULL;
+    uint8_t* chunk = NULL;
+
+    AcquireSRWLockExclusive(&c->lock);
+    if (c->free_refs != NULL)
+    {
+        buf = c->free_refs;
+        c->free_refs = *(AVBufferRef**)buf->data;
+    }
+    else if (c->free_chunks != NULL)
+    {
+        chunk = c->free_chunks;
+        c->free_chunks = *(uint8_t**)chunk;
+    }
+    else if (c->slab_end - c->slab_next >= c->size || pp_alloc_slab(pool, c) >= 0)
+    {
+        chunk = c->slab_next;
+        c->slab_next += c->size;
+    }
+    ReleaseSRWLockExclusive(&c->lock);
+
+    if (chunk != NULL)
+    {
+        // Only a chunk without a buffer reference needs the heap.
+        InterlockedIncrement64(&pool->nb_allocations);
+
+        buf = av_buffer_create(chunk, c->size, pp_release_chunk, c, 0);
+        if (buf == NULL)
+        {
+            pp_release_chunk(c, chunk);
+        }
+    }
+
+    return buf;
+}
+
+void pp_release_buffer(PacketPool* pool, AVBufferRef** buf)
+{
+    AVBufferRef* b = *buf;
+    if (b == NULL)
+    {
+        return;
+    }
+
+    // Reference could be kept for reuse only if nobody else (e.g. a snapshot) holds the payload.
+    PacketPoolClass* c = pp_get_owner(pool, b);
+    if (c == NULL || !av_buffer_is_writable(b))
+    {
+        av_buffer_unref(buf);
+        return;
+    }
+
+    AcquireSRWLockExclusive(&c->lock);
+    *(AVBufferRef**)b->data = c->free_refs;
+    c->free_refs = b;
+    ReleaseSRWLockExclusive(&c->lock);
+
+    *buf = NULL;
+}
+
+void pp_unref_packet(PacketPool* pool, AVPacket* pkt)
+{
+    pp_release_buffer(pool, &pkt->buf);
+    av_packet_unref(pkt);
+}
+
+int64_t pp_get_nb_allocations(PacketPool* pool)
+{
+    return ReadAcquire64(&pool->nb_allocations);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <libavcodec/avcodec.h>
+#include "framework.h"
+
+// Payloads are allocated from size classes of powers of two, from 256 bytes to 8 MB.
+// Larger payloads are allocated from the heap.
+#define PP_MIN_CLASS_BITS 8
+#define PP_MAX_CLASS_BITS 23
+#define PP_NB_CLASSES (PP_MAX_CLASS_BITS - PP_MIN_CLASS_BITS + 1)
+
+// Chunks of a size class are carved from slabs of this size.
+#define PP_SLAB_SIZE (2 * 1024 * 1024)
+
+// Slab header is as large as the payload alignment, so the chunks stay aligned.
+#define PP_SLAB_HEADER_SIZE 64
+
+// Back the slabs with large pages. It requires SeLockMemoryPrivilege, otherwise the regular pages are used.
+#define PP_FLAG_LARGE_PAGES 1
+
+typedef struct PacketPoolClass {
+    int size;
+    SRWLOCK lock;
+
+    // Released buffer references, linked through their payload. They are reused without any allocation.
+    AVBufferRef* free_refs;
+
+    // Chunks released by the last holder of the payload (e.g. a snapshot), they need a new buffer reference.
+    uint8_t* free_chunks;
+
+    // Slabs of the class linked through their headers, and the part of the latest slab which is not carved yet.
+    uint8_t* slabs;
+    uint8_t* slab_next;
+    uint8_t* slab_end;
+} PacketPoolClass;
+
+/**
+ * Packet payload allocator which could be shared by any number of buffers and threads.
+ *
+ * Slabs are never returned to the system until the pool is freed, the released chunks are kept in the
+ * free lists of their size class. Once the pool has grown to the peak usage, retaining a packet reuses
+ * a released buffer reference and does not touch the heap at all.
+ */
+typedef struct PacketPool {
+    int flags;
+    PacketPoolClass classes[PP_NB_CLASSES];
+
+    // Number of the heap allocations made by the pool, it stops growing in the steady state.
+    volatile LONG64 nb_allocations;
+} PacketPool;
+
+EXPORT PacketPool* pp_alloc(int flags);
+
+/**
+ * Free the pool. All the buffers of the pool must be released before.
+ */
+EXPORT void pp_free(PacketPool** pool);
+
+/**
+ * Process wide pool, it is created on the first call and lives until the process exits.
+ */
+EXPORT PacketPool* pp_get_shared(int flags);
+
+/**
+ * Get a buffer of at least the specified size.
+ */
+EXPORT AVBufferRef* pp_get_buffer(PacketPool* pool, int size);
+
+/**
+ * Release the buffer reference. Buffers which do not belong to the pool are simply unreferenced.
+ */
+EXPORT void pp_release_buffer(PacketPool* pool, AVBufferRef** buf);
+
+/**
+ * Unreference the packet and release its payload to the pool.
+ */
+EXPORT void pp_unref_packet(PacketPool* pool, AVPacket* pkt);
+
+EXPORT int64_t pp_get_nb_allocations(PacketPool* pool);
@@ -0,0 +1,188 @@
+#include "packet-ring.h"
+
+PacketRing* pr_alloc(int64_t capacity, PacketPool* pool)
+{
+    PacketRing* ring = av_mallocz(sizeof(PacketRing));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    // Capacity is a power of two, so the slot index is just a mask of the sequence number.
+    ring->capacity = 1;
+    while (ring->capacity < capacity)
+    {
+        ring->capacity <<= 1;
+    }
+    ring->mask = ring->capacity - 1;
+
+    ring->pool = pool;
+
+    ring->slots = av_mallocz_array(ring->capacity, sizeof(PacketRingSlot));
+    if (ring->slots == NULL)
+    {
+        av_freep(&ring);
+        return NULL;
+    }
+
+    // Packets are reused by the slots, so pushing and freeing the packets does not allocate.
+    for (int64_t i = 0; i < ring->capacity; i++)
+    {
+        ring->slots[i].packet = av_packet_alloc();
+        if (ring->slots[i].packet == NULL)
+        {
+            pr_free(&ring);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < PR_MAX_READERS; i++)
+    {
+        ring->pins[i] = -1;
+    }
+
+    return ring;
+}
+
+void pr_free(PacketRing** ring)
+{
+    PacketRing* r = *ring;
+    if (r == NULL)
+    {
+        return;
+    }
+
+    if (r->slots != NULL)
+    {
+        for (int64_t seq = r->reclaimed; seq < r->tail; seq++)
+        {
+            pp_unref_packet(r->pool, r->slots[seq & r->mask].packet);
+        }
+
+        for (int64_t i = 0; i < r->capacity; i++)
+        {
+            av_packet_free(&r->slots[i].packet);
+        }
+    }
+
+    av_freep(&r->slots);
+    av_freep(ring);
+}
+
+/**
+ * Free the evicted packets which could not be seen by any reader anymore.
+ */
+static void pr_reclaim(PacketRing* ring)
+{
+    int64_t limit = ReadAcquire64(&ring->head);
+    for (int i = 0; i < PR_MAX_READERS; i++)
+    {
+        int64_t pin = ReadAcquire64(&ring->pins[i]);
+        if (pin >= 0 && pin < limit)
+        {
+            limit = pin;
+        }
+    }
+
+    for (; ring->reclaimed < limit; ring->reclaimed++)
+    {
+        pp_unref_packet(ring->pool, ring->slots[ring->reclaimed & ring->mask].packet);
+    }
+}
+
+int64_t pr_get_free_slots(PacketRing* ring)
+{
+    pr_reclaim(ring);
+
+    return ring->capacity - (ring->tail - ring->reclaimed);
+}
+
+int pr_is_full(PacketRing* ring)
+{
+    return pr_get_free_slots(ring) <= 0;
+}
+
+int pr_push(PacketRing* ring, AVPacket* pkt, int64_t keyframe)
+{
+    if (pr_is_full(ring))
+    {
+        return AVERROR(EAGAIN);
+    }
+
+    PacketRingSlot* slot = &ring->slots[ring->tail & ring->mask];
+    av_packet_move_ref(slot->packet, pkt);
+    slot->keyframe = keyframe;
+
+    // Publish the slot to the readers.
+    WriteRelease64(&ring->tail, ring->tail + 1);
+
+    return 0;
+}
+
+void pr_advance_head(PacketRing* ring, int64_t seq)
+{
+    if (seq <= ring->head)
+    {
+        return;
+    }
+
+    // Full barrier: the head must be visible before the pins are checked by pr_reclaim.
+    InterlockedExchange64(&ring->head, FFMIN(seq, ring->tail));
+
+    pr_reclaim(ring);
+}
+
+int64_t pr_get_head(PacketRing* ring)
+{
+    return ReadAcquire64(&ring->head);
+}
+
+int64_t pr_get_tail(PacketRing* ring)
+{
+    return ReadAcquire64(&ring->tail);
+}
+
+AVPacket* pr_peek(PacketRing* ring, int64_t seq)
+{
+    return ring->slots[seq & ring->mask].packet;
+}
+
+int64_t pr_peek_keyframe(PacketRing* ring, int64_t seq)
+{
+    return ring->slots[seq & ring->mask].keyframe;
+}
+
+int pr_acquire(PacketRing* ring, int64_t* head)
+{
+    for (int i = 0; i < PR_MAX_READERS; i++)
+    {
+        int64_t pinned = pr_get_head(ring);
+        if (InterlockedCompareExchange64(&ring->pins[i], pinned, -1) != -1)
+        {
+            continue;
+        }
+
+        // Producer could evict and free the packets between reading the head and pinning it,
+        // so the pin is moved forward until the head stays the same after pinning.
+        int64_t current = pr_get_head(ring);
+        while (current != pinned)
+        {
+            pinned = current;
+            InterlockedExchange64(&ring->pins[i], pinned);
+            current = pr_get_head(ring);
+        }
+
+        *head = pinned;
+        return i;
+    }
+
+    return -1;
+}
+
+void pr_release(PacketRing* ring, int pin)
+{
+    if (pin >= 0)
+    {
+        InterlockedExchange64(&ring->pins[pin], -1);
+    }
+}
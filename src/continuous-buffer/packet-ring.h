@@ -0,0 +1,88 @@
+#pragma once
+
+#include <libavcodec/avcodec.h>
+#include "framework.h"
+#include "packet-pool.h"
+
+// Maximum number of readers which could hold the ring at the same time.
+#define PR_MAX_READERS 8
+
+typedef struct PacketRingSlot {
+    // Allocated once with the ring, pushed packets are moved into it.
+    AVPacket* packet;
+
+    // Sequence number of the key frame which starts the GOP of the packet.
+    int64_t keyframe;
+} PacketRingSlot;
+
+/**
+ * Single producer ring of packet references.
+ *
+ * Packets are addressed by the sequence numbers, [head, tail) are the queued packets.
+ * Only the producer pushes and evicts the packets, any number of readers (up to PR_MAX_READERS)
+ * could read the queued packets concurrently. A reader pins the head it started from, evicted
+ * packets stay allocated until all the readers which could see them are gone, so the producer
+ * never waits for the readers: it frees such packets later on one of the next writes.
+ */
+typedef struct PacketRing {
+    PacketRingSlot* slots;
+    int64_t capacity;
+    int64_t mask;
+
+    volatile LONG64 head;
+    volatile LONG64 tail;
+
+    // Evicted packets [reclaimed, head) which are not freed yet. Accessed by the producer only.
+    int64_t reclaimed;
+
+    // Head sequence numbers pinned by the readers, -1 means a free pin.
+    volatile LONG64 pins[PR_MAX_READERS];
+
+    // Payloads of the freed packets are released to the pool, could be NULL.
+    PacketPool* pool;
+} PacketRing;
+
+EXPORT PacketRing* pr_alloc(int64_t capacity, PacketPool* pool);
+
+EXPORT void pr_free(PacketRing** ring);
+
+/**
+ * Producer only. Append the packet, its reference is moved to the ring and the packet could be reused.
+ * @return 0 on success, AVERROR(EAGAIN) if the ring is full.
+ */
+EXPORT int pr_push(PacketRing* ring, AVPacket* pkt, int64_t keyframe);
+
+/**
+ * Producer only. Evict all the packets before the sequence number.
+ */
+EXPORT void pr_advance_head(PacketRing* ring, int64_t seq);
+
+/**
+ * Producer only. Check whether one more packet could be pushed.
+ */
+EXPORT int pr_is_full(PacketRing* ring);
+
+/**
+ * Producer only. Number of the packets which could be pushed.
+ */
+EXPORT int64_t pr_get_free_slots(PacketRing* ring);
+
+EXPORT int64_t pr_get_head(PacketRing* ring);
+
+EXPORT int64_t pr_get_tail(PacketRing* ring);
+
+/**
+ * Access the queued packet. Producer could peek any queued packet, reader only the packets which are not older than its pin.
+ */
+EXPORT AVPacket* pr_peek(PacketRing* ring, int64_t seq);
+
+EXPORT int64_t pr_peek_keyframe(PacketRing* ring, int64_t seq);
+
+/**
+ * Reader only. Pin the ring head, packets from the pinned head until the tail stay valid until the pin is released.
+ * @param[out] head Pinned head sequence number.
+ * @return Pin index which must be passed to pr_release, or -1 if there are too many readers.
+ */
+EXPORT int pr_acquire(PacketRing* ring, int64_t* head);
+
+EXPORT void pr_release(PacketRing* ring, int pin);
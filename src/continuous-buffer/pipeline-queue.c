@@ -0,0 +1,286 @@
+#include "pipeline-queue.h"
+
+PipelineQueue* pq_alloc(int capacity, int frames, enum PipelineQueuePolicy policy, int nb_producers)
+{
+    PipelineQueue* queue = av_mallocz(sizeof(PipelineQueue));
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    queue->capacity = FFMAX(capacity, 1);
+    queue->policy = policy;
+    queue->nb_producers = nb_producers;
+
+    InitializeSRWLock(&queue->lock);
+    InitializeConditionVariable(&queue->not_empty);
+    InitializeConditionVariable(&queue->not_full);
+
+    queue->items = av_calloc(queue->capacity, sizeof(PipelineQueueItem));
+    if (queue->items == NULL)
+    {
+        pq_free(&queue);
+        return NULL;
+    }
+
+    for (int i = 0; i < queue->capacity; i++)
+    {
+        if (frames)
+        {
+            queue->items[i].frame = av_frame_alloc();
+        }
+        else
+        {
+            queue->items[i].packet = av_packet_alloc();
+        }
+
+        if (queue->items[i].frame == NULL && queue->items[i].packet == NULL)
+        {
+            pq_free(&queue);
+            return NULL;
+        }
+    }
+
+    return queue;
+}
+
+void pq_free(PipelineQueue** queue)
+{
+    PipelineQueue* q = *queue;
+    if (q == NULL)
+    {
+        return;
+    }
+
+    if (q->items != NULL)
+    {
+        for (int i = 0; i < q->capacity; i++)
+        {
+            av_packet_free(&q->items[i].packet);
+            av_frame_free(&q->items[i].frame);
+        }
+
+        av_freep(&q->items);
+    }
+
+    av_freep(queue);
+}
+
+/**
+ * Drop the oldest item which is not audio, the lock must be held. The older audio items are moved up by one slot,
+ * so the queue order is kept.
+ * @return 1 if an item was dropped, 0 if the queue holds audio only.
+ */
+static int pq_drop_oldest(PipelineQueue* queue)
+{
+    int i = 0;
+    while (i < queue->count && queue->items[(queue->head + i) % queue->capacity].type == AVMEDIA_TYPE_AUDIO)
+    {
+        i++;
+    }
+
+    if (i == queue->count)
+    {
+        return 0;
+    }
+
+    PipelineQueueItem dropped = queue->items[(queue->head + i) % queue->capacity];
+    if (dropped.packet != NULL)
+    {
+        av_packet_unref(dropped.packet);
+    }
+    else
+    {
+        av_frame_unref(dropped.frame);
+    }
+
+    // Slots own their packet or frame, so the items are rotated and the blank one ends up in the head slot.
+    for (; i > 0; i--)
+    {
+        queue->items[(queue->head + i) % queue->capacity] = queue->items[(queue->head + i - 1) % queue->capacity];
+    }
+    queue->items[queue->head] = dropped;
+
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->nb_dropped++;
+
+    return 1;
+}
+
+/**
+ * Find the free slot for the new item, the lock must be held.
+ * @return Slot of the item, AVERROR_EXIT if the queue was aborted.
+ */
+static int pq_reserve(PipelineQueue* queue)
+{
+    while (!queue->aborted && queue->count == queue->capacity)
+    {
+        if (queue->policy == PQ_POLICY_DROP && pq_drop_oldest(queue))
+        {
+            break;
+        }
+
+        SleepConditionVariableSRW(&queue->not_full, &queue->lock, INFINITE, 0);
+    }
+
+    if (queue->aborted)
+    {
+        return AVERROR_EXIT;
+    }
+
+    return (queue->head + queue->count) % queue->capacity;
+}
+
+/**
+ * Publish the item of the reserved slot, the lock must be held.
+ */
+static void pq_commit(PipelineQueue* queue)
+{
+    queue->count++;
+    queue->nb_pushed++;
+    queue->peak = FFMAX(queue->peak, queue->count);
+
+    WakeConditionVariable(&queue->not_empty);
+}
+
+/**
+ * Wait for the oldest item, the lock must be held.
+ * @return Slot of the item, AVERROR_EOF or AVERROR_EXIT.
+ */
+static int pq_wait(PipelineQueue* queue)
+{
+    while (!queue->aborted && queue->count == 0 && queue->nb_producers > 0)
+    {
+        SleepConditionVariableSRW(&queue->not_empty, &queue->lock, INFINITE, 0);
+    }
+
+    if (queue->aborted)
+    {
+        return AVERROR_EXIT;
+    }
+
+    if (queue->count == 0)
+    {
+        return AVERROR_EOF;
+    }
+
+    return queue->head;
+}
+
+/**
+ * Release the slot of the oldest item, the lock must be held.
+ */
+static void pq_release(PipelineQueue* queue)
+{
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    WakeConditionVariable(&queue->not_full);
+}
+
+int pq_push_packet(PipelineQueue* queue, AVPacket* pkt)
+{
+    AcquireSRWLockExclusive(&queue->lock);
+
+    int slot = pq_reserve(queue);
+    if (slot >= 0)
+    {
+        av_packet_move_ref(queue->items[slot].packet, pkt);
+        pq_commit(queue);
+    }
+
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    return slot < 0 ? slot : 0;
+}
+
+int pq_push_frame(PipelineQueue* queue, AVFrame* frame, enum AVMediaType type, int64_t pts_time)
+{
+    AcquireSRWLockExclusive(&queue->lock);
+
+    int slot = pq_reserve(queue);
+    if (slot >= 0)
+    {
+        PipelineQueueItem* item = &queue->items[slot];
+        av_frame_move_ref(item->frame, frame);
+        item->type = type;
+        item->pts_time = pts_time;
+        pq_commit(queue);
+    }
+
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    return slot < 0 ? slot : 0;
+}
+
+int pq_pop_packet(PipelineQueue* queue, AVPacket* pkt)
+{
+    AcquireSRWLockExclusive(&queue->lock);
+
+    int slot = pq_wait(queue);
+    if (slot >= 0)
+    {
+        av_packet_move_ref(pkt, queue->items[slot].packet);
+        pq_release(queue);
+    }
+
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    return slot < 0 ? slot : 0;
+}
+
+int pq_pop_frame(PipelineQueue* queue, AVFrame* frame, enum AVMediaType* type, int64_t* pts_time)
+{
+    AcquireSRWLockExclusive(&queue->lock);
+
+    int slot = pq_wait(queue);
+    if (slot >= 0)
+    {
+        PipelineQueueItem* item = &queue->items[slot];
+        av_frame_move_ref(frame, item->frame);
+        *type = item->type;
+        *pts_time = item->pts_time;
+        pq_release(queue);
+    }
+
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    return slot < 0 ? slot : 0;
+}
+
+void pq_close(PipelineQueue* queue)
+{
+    AcquireSRWLockExclusive(&queue->lock);
+
+    if (queue->nb_producers > 0 && --queue->nb_producers == 0)
+    {
+        WakeAllConditionVariable(&queue->not_empty);
+    }
+
+    ReleaseSRWLockExclusive(&queue->lock);
+}
+
+void pq_abort(PipelineQueue* queue)
+{
+    AcquireSRWLockExclusive(&queue->lock);
+
+    queue->aborted = 1;
+    WakeAllConditionVariable(&queue->not_empty);
+    WakeAllConditionVariable(&queue->not_full);
+
+    ReleaseSRWLockExclusive(&queue->lock);
+}
+
+void pq_get_stats(PipelineQueue* queue, PipelineQueueStats* stats)
+{
+    AcquireSRWLockShared(&queue->lock);
+
+    stats->count = queue->count;
+    stats->capacity = queue->capacity;
+    stats->peak = queue->peak;
+    stats->nb_pushed = queue->nb_pushed;
+    stats->nb_dropped = queue->nb_dropped;
+
+    ReleaseSRWLockShared(&queue->lock);
+}
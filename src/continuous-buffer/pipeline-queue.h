@@ -0,0 +1,112 @@
+#pragma once
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include "framework.h"
+
+/**
+ * What a producer does when the queue is full.
+ */
+enum PipelineQueuePolicy {
+    // Wait until the consumer takes an item.
+    PQ_POLICY_BLOCK,
+
+    // Drop the oldest item which is not audio. Audio is never dropped (its timestamps are rebuilt from the sample
+    // count, so a dropped frame would shift it against the video), the producer waits if the queue holds audio only.
+    PQ_POLICY_DROP,
+};
+
+typedef struct PipelineQueueItem {
+    AVPacket* packet;
+    AVFrame* frame;
+    enum AVMediaType type;
+    int64_t pts_time;
+} PipelineQueueItem;
+
+typedef struct PipelineQueueStats {
+    int count;
+    int capacity;
+
+    // Highest number of the queued items.
+    int peak;
+
+    int64_t nb_pushed;
+    int64_t nb_dropped;
+} PipelineQueueStats;
+
+/**
+ * Bounded queue of the reference counted packets or frames between the threads of the pipeline.
+ * Items are moved in and out of the preallocated slots, so the queue does not allocate per item.
+ */
+typedef struct PipelineQueue {
+    PipelineQueueItem* items;
+    int capacity;
+
+    // Slot of the oldest item and the number of the queued items.
+    int head;
+    int count;
+
+    enum PipelineQueuePolicy policy;
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE not_empty;
+    CONDITION_VARIABLE not_full;
+
+    // Producers which did not close the queue yet, the consumer gets AVERROR_EOF once all of them did.
+    int nb_producers;
+
+    // Set on abort, both sides stop waiting.
+    int aborted;
+
+    int peak;
+    int64_t nb_pushed;
+    int64_t nb_dropped;
+} PipelineQueue;
+
+/**
+ * @param capacity     Number of the slots.
+ * @param frames       Nonzero for a queue of frames, zero for a queue of packets.
+ * @param nb_producers Number of the producers which close the queue.
+ */
+EXPORT PipelineQueue* pq_alloc(int capacity, int frames, enum PipelineQueuePolicy policy, int nb_producers);
+
+/**
+ * Free the queue with the items which are still queued.
+ */
+EXPORT void pq_free(PipelineQueue** queue);
+
+/**
+ * Move the packet reference to the queue. The packet is left blank.
+ * @return 0 on success, AVERROR_EXIT if the queue was aborted.
+ */
+EXPORT int pq_push_packet(PipelineQueue* queue, AVPacket* pkt);
+
+/**
+ * Move the frame reference to the queue. The frame is left blank.
+ * @return 0 on success, AVERROR_EXIT if the queue was aborted.
+ */
+EXPORT int pq_push_frame(PipelineQueue* queue, AVFrame* frame, enum AVMediaType type, int64_t pts_time);
+
+/**
+ * Move the oldest packet out of the queue, waits for one if the queue is empty.
+ * @return 0 on success, AVERROR_EOF if all the producers are done, AVERROR_EXIT if the queue was aborted.
+ */
+EXPORT int pq_pop_packet(PipelineQueue* queue, AVPacket* pkt);
+
+/**
+ * Move the oldest frame out of the queue, waits for one if the queue is empty.
+ * @return 0 on success, AVERROR_EOF if all the producers are done, AVERROR_EXIT if the queue was aborted.
+ */
+EXPORT int pq_pop_frame(PipelineQueue* queue, AVFrame* frame, enum AVMediaType* type, int64_t* pts_time);
+
+/**
+ * The calling producer is done.
+ */
+EXPORT void pq_close(PipelineQueue* queue);
+
+/**
+ * Stop the queue, the waiting producers and consumers return AVERROR_EXIT.
+ */
+EXPORT void pq_abort(PipelineQueue* queue);
+
+EXPORT void pq_get_stats(PipelineQueue* queue, PipelineQueueStats* stats);
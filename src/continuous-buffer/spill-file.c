@@ -0,0 +1,155 @@
+#include "spill-file.h"
+
+SpillFile* sf_open(const char* path, int64_t size)
+{
+    SpillFile* spill = av_mallocz(sizeof(SpillFile));
+    if (spill == NULL)
+    {
+        return NULL;
+    }
+
+    spill->refs = 1;
+    spill->extents = av_fifo_alloc_array(64, sizeof(SpillExtent*));
+    spill->file = mf_open(path, size, 0);
+    if (spill->extents == NULL || spill->file == NULL)
+    {
+        av_fifo_freep(&spill->extents);
+        mf_close(&spill->file);
+        av_freep(&spill);
+        return NULL;
+    }
+
+    return spill;
+}
+
+static void sf_unref(SpillFile* spill)
+{
+    if (InterlockedDecrement(&spill->refs) > 0)
+    {
+        return;
+    }
+
+    while (av_fifo_size(spill->extents) > 0)
+    {
+        SpillExtent* extent = NULL;
+        av_fifo_generic_read(spill->extents, &extent, sizeof(SpillExtent*), NULL);
+        av_freep(&extent);
+    }
+
+    av_fifo_freep(&spill->extents);
+    mf_close(&spill->file);
+    av_freep(&spill);
+}
+
+void sf_close(SpillFile** spill)
+{
+    if (*spill == NULL)
+    {
+        return;
+    }
+
+    sf_unref(*spill);
+    *spill = NULL;
+}
+
+/**
+ * Called by FFmpeg once the last reference to the extent is gone.
+ */
+static void sf_release_extent(void* opaque, uint8_t* data)
+{
+    SpillExtent* extent = opaque;
+    SpillFile* spill = extent->spill;
+
+    // Extent could be freed by the producer as soon as it is marked, so it is not touched after that.
+    InterlockedExchange(&extent->released, 1);
+
+    sf_unref(spill);
+}
+
+/**
+ * Free the oldest extents which are released.
+ */
+static void sf_reclaim(SpillFile* spill)
+{
+    while (av_fifo_size(spill->extents) > 0)
+    {
+        SpillExtent* extent = NULL;
+        av_fifo_generic_peek(spill->extents, &extent, sizeof(SpillExtent*), NULL);
+        if (InterlockedCompareExchange(&extent->released, 0, 0) == 0)
+        {
+            break;
+        }
+
+        av_fifo_drain(spill->extents, sizeof(SpillExtent*));
+        av_freep(&extent);
+    }
+}
+
+/**
+ * Find the offset of a free space for the extent.
+ * @return Offset or -1 if the extents which are still referenced leave no space.
+ */
+static int64_t sf_find_space(SpillFile* spill, int64_t size)
+{
+    sf_reclaim(spill);
+
+    if (av_fifo_size(spill->extents) == 0)
+    {
+        spill->write = 0;
+        return size <= spill->file->size ? 0 : -1;
+    }
+
+    SpillExtent* oldest = NULL;
+    av_fifo_generic_peek(spill->extents, &oldest, sizeof(SpillExtent*), NULL);
+
+    if (spill->write > oldest->offset)
+    {
+        // Free space is after the latest extent and before the oldest one, the extent is never split.
+        if (spill->file->size - spill->write >= size)
+        {
+            return spill->write;
+        }
+
+        return oldest->offset >= size ? 0 : -1;
+    }
+
+    return oldest->offset - spill->write >= size ? spill->write : -1;
+}
+
+AVBufferRef* sf_alloc_extent(SpillFile* spill, int64_t size)
+{
+    int64_t offset = sf_find_space(spill, size);
+    if (offset < 0 || size > INT_MAX)
+    {
+        return NULL;
+    }
+
+    if (av_fifo_space(spill->extents) < sizeof(SpillExtent*)
+        && av_fifo_grow(spill->extents, av_fifo_size(spill->extents)) < 0)
+    {
+        return NULL;
+    }
+
+    SpillExtent* extent = av_mallocz(sizeof(SpillExtent));
+    if (extent == NULL)
+    {
+        return NULL;
+    }
+
+    extent->spill = spill;
+    extent->offset = offset;
+    extent->size = size;
+
+    AVBufferRef* buf = av_buffer_create(spill->file->data + offset, (int)size, sf_release_extent, extent, 0);
+    if (buf == NULL)
+    {
+        av_freep(&extent);
+        return NULL;
+    }
+
+    InterlockedIncrement(&spill->refs);
+    av_fifo_generic_write(spill->extents, &extent, sizeof(SpillExtent*), NULL);
+    spill->write = offset + size;
+
+    return buf;
+}
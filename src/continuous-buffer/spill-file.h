@@ -0,0 +1,50 @@
+#pragma once
+
+#include <libavutil/buffer.h>
+#include <libavutil/fifo.h>
+#include "framework.h"
+#include "mapped-file.h"
+
+typedef struct SpillFile SpillFile;
+
+typedef struct SpillExtent {
+    SpillFile* spill;
+    int64_t offset;
+    int64_t size;
+
+    // Set once the last reference to the extent payload is gone.
+    volatile LONG released;
+} SpillExtent;
+
+/**
+ * Ring of extents in a preallocated memory mapped file.
+ *
+ * Extents are allocated one after another, so the file is written sequentially. An extent is handed out as
+ * a buffer reference, its space is reused only after all the references (including snapshots) are gone.
+ * Extents are allocated by the producer only, references could be released on any thread.
+ */
+struct SpillFile {
+    MappedFile* file;
+
+    // Allocated extents (SpillExtent*) from the oldest one.
+    AVFifoBuffer* extents;
+
+    // Offset of the next extent.
+    int64_t write;
+
+    // The owner reference plus one reference per allocated extent which is not released yet.
+    volatile LONG refs;
+};
+
+EXPORT SpillFile* sf_open(const char* path, int64_t size);
+
+/**
+ * Release the owner reference. The file is unmapped once the last extent is released.
+ */
+EXPORT void sf_close(SpillFile** spill);
+
+/**
+ * Producer only. Allocate an extent of the specified size.
+ * @return Buffer reference to the mapped extent, NULL if there is no space left.
+ */
+EXPORT AVBufferRef* sf_alloc_extent(SpillFile* spill, int64_t size);
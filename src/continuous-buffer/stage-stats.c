@@ -0,0 +1,134 @@
+#include "stage-stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int64_t ss_now()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart;
+}
+
+double ss_to_seconds(int64_t ticks)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    return ticks / (double)frequency.QuadPart;
+}
+
+void ss_init(StageStats* stats, const char* name)
+{
+    memset(stats, 0, sizeof(StageStats));
+    stats->name = name;
+    stats->start = ss_now();
+}
+
+/**
+ * Bucket of the sample: the position of the highest bit and the two bits after it.
+ */
+static int ss_get_bucket(int64_t ticks)
+{
+    if (ticks < 4)
+    {
+        return ticks > 0 ? (int)ticks : 0;
+    }
+
+    unsigned long msb;
+    _BitScanReverse64(&msb, ticks);
+
+    return 4 * (msb - 1) + (int)((ticks >> (msb - 2)) & 3);
+}
+
+/**
+ * Largest sample (ticks) which falls into the bucket.
+ */
+static int64_t ss_get_bucket_limit(int bucket)
+{
+    if (bucket < 4)
+    {
+        return bucket;
+    }
+
+    int msb = bucket / 4 + 1;
+    int64_t low = (int64_t)(4 + bucket % 4) << (msb - 2);
+
+    return low + ((int64_t)1 << (msb - 2)) - 1;
+}
+
+void ss_add(StageStats* stats, int64_t ticks, int64_t bytes)
+{
+    InterlockedIncrement64(&stats->count);
+    InterlockedExchangeAdd64(&stats->bytes, bytes);
+    InterlockedExchangeAdd64(&stats->total, ticks);
+    InterlockedIncrement64(&stats->buckets[ss_get_bucket(ticks)]);
+
+    // The maximum is rarely exceeded, so the exchange is rarely repeated.
+    LONG64 max = stats->max;
+    while (ticks > max)
+    {
+        LONG64 previous = InterlockedCompareExchange64(&stats->max, ticks, max);
+        if (previous == max)
+        {
+            break;
+        }
+
+        max = previous;
+    }
+}
+
+void ss_record(StageStats* stats, int64_t start, int64_t bytes)
+{
+    ss_add(stats, ss_now() - start, bytes);
+}
+
+/**
+ * Upper bound of the bucket which holds the percentile (ticks).
+ */
+static int64_t ss_get_percentile(const StageStats* stats, int64_t count, double percentile)
+{
+    int64_t rank = (int64_t)(count * percentile + 0.5);
+    int64_t seen = 0;
+
+    for (int i = 0; i < SS_NB_BUCKETS; i++)
+    {
+        seen += stats->buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            return FFMIN(ss_get_bucket_limit(i), stats->max);
+        }
+    }
+
+    return stats->max;
+}
+
+void ss_get_summary(const StageStats* stats, StageStatsSummary* summary)
+{
+    double us = ss_to_seconds(1) * 1000000;
+    double elapsed = ss_to_seconds(ss_now() - stats->start);
+
+    // Counters are read one by one, a summary of a running stage is only approximate.
+    summary->count = stats->count;
+    summary->bytes = stats->bytes;
+    summary->mean = summary->count > 0 ? stats->total * us / summary->count : 0;
+    summary->p50 = ss_get_percentile(stats, summary->count, 0.5) * us;
+    summary->p99 = ss_get_percentile(stats, summary->count, 0.99) * us;
+    summary->max = stats->max * us;
+    summary->rate = elapsed > 0 ? summary->count / elapsed : 0;
+    summary->byte_rate = elapsed > 0 ? summary->bytes / elapsed : 0;
+}
+
+void ss_print(const StageStats* stats)
+{
+    StageStatsSummary summary;
+    ss_get_summary(stats, &summary);
+    if (summary.count == 0)
+    {
+        return;
+    }
+
+    printf("%s: %"PRId64" samples (%.1f/sec, %.0f bytes/sec), mean %.0f us, p50 %.0f us, p99 %.0f us, max %.0f us\n",
+        stats->name, summary.count, summary.rate, summary.byte_rate, summary.mean, summary.p50, summary.p99, summary.max);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <libavutil/avutil.h>
+#include "framework.h"
+
+// Buckets of the latency histogram: four per power of two of the QPC ticks, so a bucket is at most 25% wide.
+#define SS_NB_BUCKETS 256
+
+/**
+ * Latency histogram and counters of one processing stage. Samples are wall time intervals of the monotonic
+ * performance counter. Recording is lock free (a few interlocked additions), so the stats could stay
+ * enabled all the time and the stage could be recorded from several threads.
+ */
+typedef struct StageStats {
+    const char* name;
+
+    // Counter value of the initialization, the rates are computed since then.
+    int64_t start;
+
+    volatile LONG64 count;
+    volatile LONG64 bytes;
+
+    // Sum and maximum of the samples (ticks).
+    volatile LONG64 total;
+    volatile LONG64 max;
+
+    volatile LONG64 buckets[SS_NB_BUCKETS];
+} StageStats;
+
+typedef struct StageStatsSummary {
+    int64_t count;
+    int64_t bytes;
+
+    // Latency in microseconds, the percentiles are the upper bounds of their histogram buckets.
+    double mean;
+    double p50;
+    double p99;
+    double max;
+
+    // Samples and bytes per second of the wall time since the initialization.
+    double rate;
+    double byte_rate;
+} StageStatsSummary;
+
+/**
+ * Current value of the monotonic performance counter (ticks).
+ */
+EXPORT int64_t ss_now();
+
+EXPORT double ss_to_seconds(int64_t ticks);
+
+EXPORT void ss_init(StageStats* stats, const char* name);
+
+/**
+ * Record the sample of the specified duration (ticks).
+ */
+EXPORT void ss_add(StageStats* stats, int64_t ticks, int64_t bytes);
+
+/**
+ * Record the sample which lasted from the start (ss_now) until now.
+ */
+EXPORT void ss_record(StageStats* stats, int64_t start, int64_t bytes);
+
+EXPORT void ss_get_summary(const StageStats* stats, StageStatsSummary* summary);
+
+/**
+ * Print the summary of the stage to stdout, nothing is printed for the stages without samples.
+ */
+EXPORT void ss_print(const StageStats* stats);
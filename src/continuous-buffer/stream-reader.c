@@ -1,9 +1,28 @@
 #include "stream-reader.h"
 #include "utils.h"
 
-static int decode_packet(AVCodecContext* dec, const AVPacket* pkt, AVFrame* frame, int (*callback)(AVFrame* frame, enum AVMediaType type, int64_t pts_time))
+/**
+ * Read the next packet, the time spent in the demuxer is recorded.
+ */
+static int sr_read_frame(StreamReader* reader, AVPacket* pkt)
+{
+    int64_t start = ss_now();
+    int ret = av_read_frame(reader->input_context, pkt);
+    ss_record(&reader->stats[SR_STAGE_DEMUX], start, ret >= 0 ? pkt->size : 0);
+
+    return ret;
+}
+
+/**
+ * Decode the packet and pass the frames to the callback, or to the frame queue if it is specified.
+ * The decoding time excludes the callback and the wait for the frame queue.
+ */
+static int decode_packet(StreamReader* reader, AVCodecContext* dec, const AVPacket* pkt, AVFrame* frame, int (*callback)(AVFrame* frame, enum AVMediaType type, int64_t pts_time),
+    PipelineQueue* frames)
 {
     int ret = 0;
+    int64_t start = ss_now();
+    int64_t delivery = 0;
 
     // submit the packet to the decoder
     ret = avcodec_send_packet(dec, pkt);
@@ -26,30 +45,43 @@ static int decode_packet(AVCodecContext* dec, const AVPacket* pkt, AVFrame* fram
         if (ret < 0) {
             // those two return values are special and mean there is no output
             // frame available, but there were no errors during decoding
-            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-                return 0;
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+                ret = 0;
+                break;
+            }
 
             fprintf(stderr, "Error during decoding (%s)\n", av_err2str(ret));
-            return ret;
+            break;
         }
 
-        if (callback(frame, dec->codec->type, pts_time) < 0)
+        int64_t delivery_start = ss_now();
+        if (frames != NULL)
         {
-            return -1;
+            ret = pq_push_frame(frames, frame, dec->codec->type, pts_time);
         }
+        else
+        {
+            ret = callback(frame, dec->codec->type, pts_time) < 0 ? -1 : 0;
+            ss_record(&reader->stats[SR_STAGE_CALLBACK], delivery_start, 0);
+        }
+        delivery += ss_now() - delivery_start;
 
         av_frame_unref(frame);
-        if (ret < 0)
-            return ret;        
     }
 
-    return 0;
+    ss_add(&reader->stats[SR_STAGE_DECODE], ss_now() - start - delivery, pkt != NULL ? pkt->size : 0);
+
+    return ret;
 }
 
-StreamReader* sr_open_stream_from_format(const char* input, AVInputFormat* format, AVDictionary** opts)
+StreamReader* sr_open_stream_from_format(const char* input, AVInputFormat* format, AVDictionary** opts, const AVDictionary* decoder_opts)
 {
     StreamReader* reader = av_mallocz(sizeof(StreamReader));
 
+    ss_init(&reader->stats[SR_STAGE_DEMUX], "Demux");
+    ss_init(&reader->stats[SR_STAGE_DECODE], "Decode");
+    ss_init(&reader->stats[SR_STAGE_CALLBACK], "Frame callback");
+
     AVFormatContext* inputFormat = NULL;
     /* open input file, and allocate format context */    
 
@@ -70,14 +102,14 @@ StreamReader* sr_open_stream_from_format(const char* input, AVInputFormat* forma
 
     int videoStreamIdx = -1;
     AVCodecContext* videoDecCtx = NULL;
-    if (open_codec_context(&videoStreamIdx, &videoDecCtx, inputFormat, AVMEDIA_TYPE_VIDEO) == 0) {
+    if (open_codec_context(&videoStreamIdx, &videoDecCtx, inputFormat, AVMEDIA_TYPE_VIDEO, decoder_opts) == 0) {
         reader->video_decoder = videoDecCtx;
     }
     reader->video_stream_index = videoStreamIdx;
 
     int audioStreamIdx = -1;
     AVCodecContext* audioDecCtx = NULL;
-    if (open_codec_context(&audioStreamIdx, &audioDecCtx, inputFormat, AVMEDIA_TYPE_AUDIO) == 0) {
+    if (open_codec_context(&audioStreamIdx, &audioDecCtx, inputFormat, AVMEDIA_TYPE_AUDIO, decoder_opts) == 0) {
         reader->audio_decoder = audioDecCtx;
     }
     reader->audio_stream_index = audioStreamIdx;
@@ -88,7 +120,7 @@ StreamReader* sr_open_stream_from_format(const char* input, AVInputFormat* forma
     return reader;
 }
 
-StreamReader* sr_open_input(const char* input, const char* format, AVDictionary** opts)
+StreamReader* sr_open_input(const char* input, const char* format, AVDictionary** opts, const AVDictionary* decoder_opts)
 {
     const AVInputFormat* iformat = av_find_input_format(format);
     if (iformat == NULL)
@@ -96,14 +128,14 @@ StreamReader* sr_open_input(const char* input, const char* format, AVDictionary*
         return NULL;
     }
 
-    StreamReader* reader = sr_open_stream_from_format(input, iformat, opts);
+    StreamReader* reader = sr_open_stream_from_format(input, iformat, opts, decoder_opts);
 
     return reader;
 }
 
-StreamReader* sr_open_stream(const char* input, AVDictionary** opts)
+StreamReader* sr_open_stream(const char* input, AVDictionary** opts, const AVDictionary* decoder_opts)
 {
-    StreamReader* reader = sr_open_stream_from_format(input, NULL, opts);
+    StreamReader* reader = sr_open_stream_from_format(input, NULL, opts, decoder_opts);
 
     return reader;
 }
@@ -122,43 +154,273 @@ int sr_read_stream(StreamReader* reader, int (*callback)(AVFrame* frame, enum AV
         return -1;
     }
 
-    clock_t begin = clock();
     int ret = 0;
     /* read frames from the file */
-    while (av_read_frame(reader->input_context, pkt) >= 0) {
+    while (sr_read_frame(reader, pkt) >= 0) {
 
         // check if the packet belongs to a stream we are interested in, otherwise
         // skip it
         if (pkt->stream_index == reader->video_stream_index)
-            ret = decode_packet(reader->video_decoder, pkt, frame, callback);
+            ret = decode_packet(reader, reader->video_decoder, pkt, frame, callback, NULL);
         else if (pkt->stream_index == reader->audio_stream_index)
-            ret = decode_packet(reader->audio_decoder, pkt, frame, callback);
+            ret = decode_packet(reader, reader->audio_decoder, pkt, frame, callback, NULL);
         av_packet_unref(pkt);
         if (ret < 0)
             break;
     }
 
-    clock_t end = clock();
-    double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-    printf("Reading time %f\n", time_spent);
-
     av_packet_free(&pkt);
     if (ret == 0)
     {
         /* flush the decoders */
         if (reader->video_stream_index >= 0)
-            decode_packet(reader->video_decoder, NULL, frame, callback);
+            decode_packet(reader, reader->video_decoder, NULL, frame, callback, NULL);
         if (reader->audio_stream_index >= 0)
-            decode_packet(reader->audio_decoder, NULL, frame, callback);
+            decode_packet(reader, reader->audio_decoder, NULL, frame, callback, NULL);
+    }
+
+    av_frame_free(&frame);
+}
+
+int sr_read_packets(StreamReader* reader, int (*callback)(AVPacket* pkt, enum AVMediaType type, AVRational time_base))
+{
+    AVPacket* pkt = av_packet_alloc();
+    if (!pkt) {
+        fprintf(stderr, "Could not allocate packet\n");
+        return -1;
+    }
+
+    int ret = 0;
+    /* read packets from the file */
+    while ((ret = sr_read_frame(reader, pkt)) >= 0) {
+
+        // check if the packet belongs to a stream we are interested in, otherwise
+        // skip it
+        if (pkt->stream_index == reader->video_stream_index || pkt->stream_index == reader->audio_stream_index)
+        {
+            AVStream* st = reader->input_context->streams[pkt->stream_index];
+            int64_t start = ss_now();
+            ret = callback(pkt, st->codecpar->codec_type, st->time_base);
+            ss_record(&reader->stats[SR_STAGE_CALLBACK], start, 0);
+        }
+        av_packet_unref(pkt);
+        if (ret < 0)
+            break;
+    }
+
+    av_packet_free(&pkt);
+
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+/**
+ * Decoding thread of one stream of the pipelined read.
+ */
+typedef struct StreamReaderDecoder {
+    StreamReader* reader;
+    AVCodecContext* decoder;
+    PipelineQueue* packets;
+    PipelineQueue* frames;
+    HANDLE thread;
+    int result;
+} StreamReaderDecoder;
+
+static DWORD WINAPI sr_demux_thread(LPVOID param)
+{
+    StreamReader* reader = param;
+
+    AVPacket* pkt = av_packet_alloc();
+    int ret = pkt != NULL ? 0 : AVERROR(ENOMEM);
+
+    while (ret >= 0 && sr_read_frame(reader, pkt) >= 0)
+    {
+        // Push fails only when the pipeline is aborted.
+        if (pkt->stream_index == reader->video_stream_index && reader->video_packets != NULL)
+            ret = pq_push_packet(reader->video_packets, pkt);
+        else if (pkt->stream_index == reader->audio_stream_index && reader->audio_packets != NULL)
+            ret = pq_push_packet(reader->audio_packets, pkt);
+        av_packet_unref(pkt);
+    }
+
+    av_packet_free(&pkt);
+
+    // Decoders drain their queues and flush.
+    if (reader->video_packets != NULL)
+        pq_close(reader->video_packets);
+    if (reader->audio_packets != NULL)
+        pq_close(reader->audio_packets);
+
+    return 0;
+}
+
+static DWORD WINAPI sr_decode_thread(LPVOID param)
+{
+    StreamReaderDecoder* d = param;
+
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    int ret = pkt != NULL && frame != NULL ? 0 : AVERROR(ENOMEM);
+
+    while (ret >= 0 && (ret = pq_pop_packet(d->packets, pkt)) >= 0)
+    {
+        ret = decode_packet(d->reader, d->decoder, pkt, frame, NULL, d->frames);
+        av_packet_unref(pkt);
+    }
+
+    if (ret == AVERROR_EOF)
+    {
+        /* flush the decoder */
+        ret = decode_packet(d->reader, d->decoder, NULL, frame, NULL, d->frames);
+    }
+    else if (ret != AVERROR_EXIT)
+    {
+        // The demuxer stops on the next packet of this stream, the other stream is finished normally.
+        pq_abort(d->packets);
+    }
+
+    pq_close(d->frames);
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+
+    d->result = ret;
+
+    return 0;
+}
+
+/**
+ * Free the queues of the previous pipelined read.
+ */
+static void sr_free_pipeline(StreamReader* reader)
+{
+    pq_free(&reader->video_packets);
+    pq_free(&reader->audio_packets);
+    pq_free(&reader->frames);
+}
+
+static void sr_abort_pipeline(StreamReader* reader)
+{
+    if (reader->video_packets != NULL)
+        pq_abort(reader->video_packets);
+    if (reader->audio_packets != NULL)
+        pq_abort(reader->audio_packets);
+    pq_abort(reader->frames);
+}
+
+int sr_read_stream_pipelined(StreamReader* reader, int (*callback)(AVFrame* frame, enum AVMediaType type, int64_t pts_time),
+    int queue_size, enum PipelineQueuePolicy policy)
+{
+    StreamReaderDecoder decoders[2] = { { reader, reader->video_decoder }, { reader, reader->audio_decoder } };
+    PipelineQueue** packets[2] = { &reader->video_packets, &reader->audio_packets };
+    int nb_decoders = (reader->video_decoder != NULL) + (reader->audio_decoder != NULL);
+    HANDLE demuxer = NULL;
+    int ret = 0;
+
+    sr_free_pipeline(reader);
+
+    AVFrame* frame = av_frame_alloc();
+    reader->frames = pq_alloc(queue_size, 1, policy, nb_decoders);
+    if (frame == NULL || reader->frames == NULL)
+    {
+        fprintf(stderr, "Could not allocate the frame queue\n");
+        ret = AVERROR(ENOMEM);
+        goto done;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (decoders[i].decoder == NULL)
+        {
+            continue;
+        }
+
+        // Packets are never dropped, the decoders would lose their references.
+        *packets[i] = pq_alloc(queue_size, 0, PQ_POLICY_BLOCK, 1);
+        if (*packets[i] == NULL)
+        {
+            fprintf(stderr, "Could not allocate the packet queue\n");
+            ret = AVERROR(ENOMEM);
+            goto done;
+        }
+
+        decoders[i].packets = *packets[i];
+        decoders[i].frames = reader->frames;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (decoders[i].packets != NULL)
+        {
+            decoders[i].thread = CreateThread(NULL, 0, sr_decode_thread, &decoders[i], 0, NULL);
+            if (decoders[i].thread == NULL)
+            {
+                fprintf(stderr, "Could not start the decoding thread\n");
+                ret = -1;
+                goto done;
+            }
+        }
+    }
+
+    demuxer = CreateThread(NULL, 0, sr_demux_thread, reader, 0, NULL);
+    if (demuxer == NULL)
+    {
+        fprintf(stderr, "Could not start the demuxing thread\n");
+        ret = -1;
+        goto done;
+    }
+
+    enum AVMediaType type;
+    int64_t pts_time;
+    while ((ret = pq_pop_frame(reader->frames, frame, &type, &pts_time)) >= 0)
+    {
+        int64_t start = ss_now();
+        ret = callback(frame, type, pts_time);
+        ss_record(&reader->stats[SR_STAGE_CALLBACK], start, 0);
+        av_frame_unref(frame);
+        if (ret < 0)
+            break;
+    }
+
+    ret = ret == AVERROR_EOF ? 0 : ret;
+
+done:
+    if (ret < 0 && reader->frames != NULL)
+    {
+        sr_abort_pipeline(reader);
+    }
+
+    if (demuxer != NULL)
+    {
+        WaitForSingleObject(demuxer, INFINITE);
+        CloseHandle(demuxer);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (decoders[i].thread != NULL)
+        {
+            WaitForSingleObject(decoders[i].thread, INFINITE);
+            CloseHandle(decoders[i].thread);
+
+            if (ret == 0 && decoders[i].result < 0 && decoders[i].result != AVERROR_EXIT)
+            {
+                ret = decoders[i].result;
+            }
+        }
     }
-    
+
+    // Queues are kept, so their stats could be checked with pq_get_stats after the read.
     av_frame_free(&frame);
+
+    return ret;
 }
 
 int sr_free_reader(StreamReader** reader)
 {
     StreamReader* r = *reader;
 
+    sr_free_pipeline(r);
+
     if (r->audio_decoder != NULL)
     {
         avcodec_free_context(&r->audio_decoder);
@@ -186,4 +448,24 @@ float sr_get_number_of_video_frames_per_second(StreamReader* reader)
     AVStream* stream = reader->input_context->streams[reader->video_stream_index];
 
     return stream->avg_frame_rate.num / (float)stream->avg_frame_rate.den;
-}
\ No newline at end of file
+}
+
+int sr_get_stage_stats(StreamReader* reader, enum StreamReaderStage stage, StageStatsSummary* summary)
+{
+    if (stage < 0 || stage >= SR_NB_STAGES)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    ss_get_summary(&reader->stats[stage], summary);
+
+    return 0;
+}
+
+void sr_print_stats(StreamReader* reader)
+{
+    for (int i = 0; i < SR_NB_STAGES; i++)
+    {
+        ss_print(&reader->stats[i]);
+    }
+}
@@ -3,6 +3,24 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include "framework.h"
+#include "pipeline-queue.h"
+#include "stage-stats.h"
+
+// Default depth of the queues of the pipelined read.
+#define SR_DEFAULT_QUEUE_SIZE 8
+
+enum StreamReaderStage {
+    // av_read_frame, bytes are the packet sizes.
+    SR_STAGE_DEMUX,
+
+    // Sending a packet to the decoder and receiving its frames, bytes are the packet sizes.
+    SR_STAGE_DECODE,
+
+    // Callback of the reader, per frame (or per packet of sr_read_packets).
+    SR_STAGE_CALLBACK,
+
+    SR_NB_STAGES,
+};
 
 typedef struct StreamReader {
 
@@ -12,16 +30,55 @@ typedef struct StreamReader {
     AVCodecContext* audio_decoder;
     int audio_stream_index;
 
+    // Queues of the pipelined read. The callback could check their occupancy with pq_get_stats, they are kept
+    // after the read (until the next pipelined read or sr_free_reader), so their peak and drop counts could be checked too.
+    PipelineQueue* video_packets;
+    PipelineQueue* audio_packets;
+    PipelineQueue* frames;
+
+    // Latency of the stages since the reader was opened.
+    StageStats stats[SR_NB_STAGES];
+
 } StreamReader;
 
-EXPORT StreamReader* sr_open_stream_from_format(const char* input, AVInputFormat* format, AVDictionary** opts);
+/**
+ * Open the input and the decoders of its best video and audio streams. The options of the decoders
+ * (e.g. "threads", "thread_type") are applied to both, the decoders use a thread per core unless "threads" is set.
+ */
+EXPORT StreamReader* sr_open_stream_from_format(const char* input, AVInputFormat* format, AVDictionary** opts, const AVDictionary* decoder_opts);
 
-EXPORT StreamReader* sr_open_stream(const char* input, AVDictionary** opts);
+EXPORT StreamReader* sr_open_stream(const char* input, AVDictionary** opts, const AVDictionary* decoder_opts);
 
-EXPORT StreamReader* sr_open_input(const char* input, const char* format, AVDictionary** opts);
+EXPORT StreamReader* sr_open_input(const char* input, const char* format, AVDictionary** opts, const AVDictionary* decoder_opts);
 
 EXPORT int sr_read_stream(StreamReader* reader, int (*callback)(AVFrame* frame, enum AVMediaType type, int64_t pts_time));
 
+/**
+ * Read the stream with demuxing, decoding of each stream and the callback on separate threads. The threads are
+ * connected by the bounded queues of queue_size items. Packet queues always block the demuxer when they are full,
+ * the policy applies to the frame queue in front of the callback, so a slow callback could drop the oldest video frames
+ * instead of stalling the decoders and the demuxer. Audio frames are never dropped. The callback is called on the
+ * calling thread.
+ */
+EXPORT int sr_read_stream_pipelined(StreamReader* reader, int (*callback)(AVFrame* frame, enum AVMediaType type, int64_t pts_time),
+    int queue_size, enum PipelineQueuePolicy policy);
+
+/**
+ * Read the packets of the video and audio streams without decoding them. The callback gets the packets
+ * with the time base of their input stream, e.g. to pass them to sw_write_packet.
+ */
+EXPORT int sr_read_packets(StreamReader* reader, int (*callback)(AVPacket* pkt, enum AVMediaType type, AVRational time_base));
+
 EXPORT int sr_free_reader(StreamReader** reader);
 
-EXPORT float sr_get_number_of_video_frames_per_second(StreamReader* reader);
\ No newline at end of file
+EXPORT float sr_get_number_of_video_frames_per_second(StreamReader* reader);
+
+/**
+ * @return 0 on success, AVERROR(EINVAL) if there is no such stage.
+ */
+EXPORT int sr_get_stage_stats(StreamReader* reader, enum StreamReaderStage stage, StageStatsSummary* summary);
+
+/**
+ * Print the summary of all the stages to stdout.
+ */
+EXPORT void sr_print_stats(StreamReader* reader);
@@ -30,16 +30,39 @@ StreamWriter* sw_allocate_writer_from_format(const char* output, const AVOutputF
 
     writer->output_context = outputFormat;
 
+    ss_init(&writer->stats[SW_STAGE_SCALE], "Scale");
+    ss_init(&writer->stats[SW_STAGE_RESAMPLE], "Resample");
+    ss_init(&writer->stats[SW_STAGE_ENCODE], "Encode");
+    ss_init(&writer->stats[SW_STAGE_WRITE_PACKET], "Write packet");
+
     return writer;
 }
 
+static int sw_encode_audio_fifo(StreamWriter* writer, int final);
+
+/**
+ * Number of samples per encoded audio frame, encoders with a variable frame size get the default one.
+ */
+static int sw_get_audio_frame_size(StreamWriter* writer)
+{
+    return writer->audio_encoder->frame_size > 0 ? writer->audio_encoder->frame_size : SW_DEFAULT_AUDIO_FRAME_SIZE;
+}
+
 int sw_close_writer(StreamWriter* writer)
 {
     StreamWriter* w = writer;
     AVFormatContext* afc = w->output_context;
+    int ret = 0;
 
     if (w->audio_encoder != NULL)
     {
+        // Samples which are left in the FIFO are encoded, if the encoder accepts a smaller last frame.
+        // The writer is closed anyway, the error is returned at the end.
+        if (w->audio_fifo != NULL)
+        {
+            ret = sw_encode_audio_fifo(w, 1);
+        }
+
         AVPacket* pkt = av_packet_alloc();
         write_frame(afc, w->audio_encoder, afc->streams[w->audio_stream_index], NULL, pkt);
         av_packet_free(&pkt);
@@ -64,6 +87,23 @@ int sw_close_writer(StreamWriter* writer)
         avcodec_free_context(&w->video_encoder);
     }
 
+    swr_free(&w->swr_context);
+    av_audio_fifo_free(w->audio_fifo);
+    w->audio_fifo = NULL;
+    if (w->converted_samples != NULL)
+    {
+        av_freep(&w->converted_samples[0]);
+        av_freep(&w->converted_samples);
+    }
+    av_frame_free(&w->audio_frame);
+    av_packet_free(&w->audio_packet);
+
+    fs_free(&w->scaler);
+    av_frame_free(&w->video_frame);
+    av_packet_free(&w->video_packet);
+    av_frame_free(&w->passthrough_frame);
+    av_packet_free(&w->passthrough_packet);
+
     if (!(w->output_context->oformat->flags & AVFMT_NOFILE))
     {
         /* Close the output file. */
@@ -72,6 +112,8 @@ int sw_close_writer(StreamWriter* writer)
 
     /* free the stream */
     avformat_free_context(w->output_context);
+
+    return ret;
 }
 
 int sw_free_writer(StreamWriter** writer)
@@ -79,7 +121,8 @@ int sw_free_writer(StreamWriter** writer)
     av_freep(writer);
 }
 
-int sw_allocate_video_stream(StreamWriter* writer, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format)
+int sw_allocate_video_stream(StreamWriter* writer, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format,
+    enum EncoderProfile profile, const AVDictionary* opts)
 {
     AVCodecContext* c = NULL;
 
@@ -115,32 +158,29 @@ int sw_allocate_video_stream(StreamWriter* writer, enum AVCodecID codecId, AVRat
 
     st->time_base = c->time_base;
 
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    c->gop_size = 10;
-    c->max_b_frames = 1;
     c->pix_fmt = pixel_format;
 
-    if (codec == AV_CODEC_ID_H264)
-        av_opt_set(c->priv_data, "preset", "slow", 0);
+    /* options of the caller take precedence over the profile */
+    AVDictionary* enc_opts = NULL;
+    av_dict_copy(&enc_opts, opts, 0);
+    set_encoder_profile(c, codec, profile, &enc_opts);
+
+    /* Some formats want stream headers to be separate. */
+    if (writer->output_context->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     /* open it */
-    if (avcodec_open2(c, codec, NULL) < 0) {
+    int ret = avcodec_open2(c, codec, &enc_opts);
+    av_dict_free(&enc_opts);
+    if (ret < 0) {
         fprintf(stderr, "Could not open codec\n");
         return -1;
     }
 
-    /* Some formats want stream headers to be separate. */
-    if (writer->output_context->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
     avcodec_parameters_from_context(st->codecpar, c);
 
     writer->video_encoder = c;
+    writer->video_stream_index = st->index;
 
     return 0;
 }
@@ -185,17 +225,18 @@ int sw_allocate_audio_stream(StreamWriter* writer, enum AVCodecID codecId, int64
     c->sample_rate = select_sample_rate(codec);
     c->channel_layout = channel_layout;
 
+    /* Some formats want stream headers to be separate. */
+    if (writer->output_context->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
     /* open it */
     if (avcodec_open2(c, codec, NULL) < 0) {
         fprintf(stderr, "Could not open codec\n");
         return -1;
     }
 
-    /* Some formats want stream headers to be separate. */
-    if (writer->output_context->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
     writer->audio_encoder = c;
+    writer->audio_stream_index = st->index;
 
     st->time_base = (AVRational){ 1, c->sample_rate };
 
@@ -204,6 +245,40 @@ int sw_allocate_audio_stream(StreamWriter* writer, enum AVCodecID codecId, int64
     return 0;
 }
 
+int sw_allocate_stream_from_parameters(StreamWriter* writer, const AVCodecParameters* par, AVRational time_base)
+{
+    if (par->codec_type != AVMEDIA_TYPE_VIDEO && par->codec_type != AVMEDIA_TYPE_AUDIO) {
+        fprintf(stderr, "Only video and audio streams could be written\n");
+        return -1;
+    }
+
+    AVStream* st = avformat_new_stream(writer->output_context, NULL);
+    if (st == NULL) {
+        fprintf(stderr, "Could not allocate stream\n");
+        return -1;
+    }
+
+    st->id = writer->output_context->nb_streams - 1;
+
+    if (avcodec_parameters_copy(st->codecpar, par) < 0) {
+        fprintf(stderr, "Could not copy the codec parameters\n");
+        return -1;
+    }
+
+    /* the tag of the input container could be invalid in the output one */
+    st->codecpar->codec_tag = 0;
+
+    /* the muxer could still change it when the header is written */
+    st->time_base = time_base;
+
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+        writer->video_stream_index = st->index;
+    else
+        writer->audio_stream_index = st->index;
+
+    return 0;
+}
+
 int sw_open_writer(StreamWriter* writer, AVDictionary** options)
 {
     av_dump_format(writer->output_context, 0, writer->output, 1);
@@ -227,81 +302,179 @@ int sw_open_writer(StreamWriter* writer, AVDictionary** options)
         return -1;
     }
 
+    // Packets and the passthrough frame are reused by all the writes.
+    writer->passthrough_frame = av_frame_alloc();
+    writer->passthrough_packet = av_packet_alloc();
+    writer->video_packet = writer->video_encoder != NULL ? av_packet_alloc() : NULL;
+    writer->audio_packet = writer->audio_encoder != NULL ? av_packet_alloc() : NULL;
+    if (writer->passthrough_frame == NULL || writer->passthrough_packet == NULL || (writer->video_encoder != NULL && writer->video_packet == NULL)
+        || (writer->audio_encoder != NULL && writer->audio_packet == NULL))
+    {
+        fprintf(stderr, "Could not allocate the packet\n");
+        return -1;
+    }
+
     return ret;
 }
 
 /**
- * Initialize a temporary storage for the specified number of audio samples.
- * The conversion requires temporary storage due to the different format.
- * The number of audio samples to be allocated is specified in frame_size.
- * @param[out] converted_input_samples Array of converted samples. The
- *                                     dimensions are reference, channel
- *                                     (for multi-channel audio), sample.
- * @param      output_codec_context    Codec context of the output file
- * @param      frame_size              Number of samples to be converted in
- *                                     each round
+ * Make sure the converted sample storage could hold the specified number of samples.
+ * The storage is kept by the writer and grows only when a larger frame arrives.
  * @return Error code (0 if successful)
  */
-static int init_converted_samples(uint8_t*** converted_input_samples,
-    AVCodecContext* output_codec_context,
-    int frame_size)
+static int sw_reserve_converted_samples(StreamWriter* writer, int nb_samples)
 {
-    int error;
+    AVCodecContext* c = writer->audio_encoder;
+    if (writer->converted_samples != NULL && nb_samples <= writer->converted_capacity)
+    {
+        return 0;
+    }
+
+    if (writer->converted_samples != NULL)
+    {
+        av_freep(&writer->converted_samples[0]);
+        av_freep(&writer->converted_samples);
+    }
 
     /* Allocate as many pointers as there are audio channels.
      * Each pointer will later point to the audio samples of the corresponding
      * channels (although it may be NULL for interleaved formats).
      */
-    if (!(*converted_input_samples = calloc(output_codec_context->channels,
-        sizeof(**converted_input_samples)))) {
+    writer->converted_samples = av_calloc(c->channels, sizeof(*writer->converted_samples));
+    if (writer->converted_samples == NULL)
+    {
         fprintf(stderr, "Could not allocate converted input sample pointers\n");
         return AVERROR(ENOMEM);
     }
 
     /* Allocate memory for the samples of all channels in one consecutive
      * block for convenience. */
-    if ((error = av_samples_alloc(*converted_input_samples, NULL,
-        output_codec_context->channels,
-        frame_size,
-        output_codec_context->sample_fmt, 0)) < 0) {
-        fprintf(stderr,
-            "Could not allocate converted input samples (error '%s')\n",
-            av_err2str(error));
-        av_freep(&(*converted_input_samples)[0]);
-        free(*converted_input_samples);
+    int error = av_samples_alloc(writer->converted_samples, NULL, c->channels, nb_samples, c->sample_fmt, 0);
+    if (error < 0)
+    {
+        fprintf(stderr, "Could not allocate converted input samples (error '%s')\n", av_err2str(error));
+        av_freep(&writer->converted_samples);
+        writer->converted_capacity = 0;
         return error;
     }
+
+    writer->converted_capacity = nb_samples;
+
+    return 0;
+}
+
+/**
+ * Prepare the conversion stage for the source frame. The resampler, the FIFO, the frame and the packet
+ * are allocated by the first call, the resampler is rebuilt only if the source format changes.
+ * @return Error code (0 if successful)
+ */
+static int sw_prepare_audio_conversion(StreamWriter* writer, AVFrame* frame)
+{
+    AVCodecContext* c = writer->audio_encoder;
+
+    int64_t channel_layout = frame->channel_layout;
+    if (channel_layout == 0)
+    {
+        channel_layout = av_get_default_channel_layout(frame->channels);
+    }
+
+    if (writer->swr_context == NULL || channel_layout != writer->swr_channel_layout
+        || frame->sample_rate != writer->swr_sample_rate || frame->format != writer->swr_format)
+    {
+        // Resampler keeps its delayed samples between the calls, so it is rebuilt only for a different source.
+        swr_free(&writer->swr_context);
+        writer->swr_context = swr_alloc();
+        if (writer->swr_context == NULL)
+        {
+            fprintf(stderr, "Could not allocate the resampler\n");
+            return AVERROR(ENOMEM);
+        }
+
+        av_opt_set_channel_layout(writer->swr_context, "in_channel_layout", channel_layout, 0);
+        av_opt_set_channel_layout(writer->swr_context, "out_channel_layout", c->channel_layout, 0);
+        av_opt_set_int(writer->swr_context, "in_sample_rate", frame->sample_rate, 0);
+        av_opt_set_int(writer->swr_context, "out_sample_rate", c->sample_rate, 0);
+        av_opt_set_sample_fmt(writer->swr_context, "in_sample_fmt", frame->format, 0);
+        av_opt_set_sample_fmt(writer->swr_context, "out_sample_fmt", c->sample_fmt, 0);
+
+        int ret = swr_init(writer->swr_context);
+        if (ret < 0)
+        {
+            fprintf(stderr, "swr_init error: %s\n", av_err2str(ret));
+            swr_free(&writer->swr_context);
+            return ret;
+        }
+
+        writer->swr_channel_layout = channel_layout;
+        writer->swr_sample_rate = frame->sample_rate;
+        writer->swr_format = frame->format;
+    }
+
+    if (writer->audio_fifo == NULL)
+    {
+        writer->audio_fifo = av_audio_fifo_alloc(c->sample_fmt, c->channels, sw_get_audio_frame_size(writer));
+        if (writer->audio_fifo == NULL)
+        {
+            fprintf(stderr, "Could not allocate FIFO\n");
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    if (writer->audio_frame == NULL)
+    {
+        writer->audio_frame = av_frame_alloc();
+        if (writer->audio_frame == NULL)
+        {
+            fprintf(stderr, "Could not allocate the frame\n");
+            return AVERROR(ENOMEM);
+        }
+
+        writer->audio_frame->channels = c->channels;
+        writer->audio_frame->channel_layout = c->channel_layout;
+        writer->audio_frame->sample_rate = c->sample_rate;
+        writer->audio_frame->format = c->sample_fmt;
+        writer->audio_frame->nb_samples = sw_get_audio_frame_size(writer);
+
+        /* Allocate the samples of the created frame. This call will make
+         * sure that the audio frame can hold as many samples as specified. */
+        int ret = av_frame_get_buffer(writer->audio_frame, 0);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Could not allocate output frame samples (error '%s')\n", av_err2str(ret));
+            av_frame_free(&writer->audio_frame);
+            return ret;
+        }
+    }
+
     return 0;
 }
 
 /**
  * Convert the input audio samples into the output sample format.
- * The conversion happens on a per-frame basis, the size of which is
- * specified by frame_size.
- * @param      input_data       Samples to be decoded. The dimensions are
+ * @param      input_data       Samples to be converted. The dimensions are
  *                              channel (for multi-channel audio), sample.
+ * @param      nb_samples       Number of input samples
  * @param[out] converted_data   Converted samples. The dimensions are channel
  *                              (for multi-channel audio), sample.
- * @param      frame_size       Number of samples to be converted
+ * @param      capacity         Number of samples the converted data could hold
  * @param      resample_context Resample context for the conversion
- * @return Error code (0 if successful)
+ * @return Number of converted samples, negative error code on failure
  */
-static int convert_samples(const uint8_t** input_data,
-    uint8_t** converted_data, const int frame_size,
+static int convert_samples(const uint8_t** input_data, const int nb_samples,
+    uint8_t** converted_data, const int capacity,
     SwrContext* resample_context)
 {
-    int error;
+    int converted;
 
     /* Convert the samples using the resampler. */
-    if ((error = swr_convert(resample_context,
-        converted_data, frame_size,
-        input_data, frame_size)) < 0) {
+    if ((converted = swr_convert(resample_context,
+        converted_data, capacity,
+        input_data, nb_samples)) < 0) {
         fprintf(stderr, "Could not convert input samples (error '%s')\n",
-            av_err2str(error));
-        return error;
+            av_err2str(converted));
     }
 
-    return 0;
+    return converted;
 }
 
 /**
@@ -334,207 +507,297 @@ static int add_samples_to_fifo(AVAudioFifo* fifo,
     return 0;
 }
 
-int sw_write_video_frames(StreamWriter* writer, AVFrame* frames, int nb_frames)
+/**
+ * Prepare the conversion stage for the source frame. The scaler, the converted frame and the packet are allocated
+ * by the first call, the scaler is rebuilt only if the source frame differs from the previous one.
+ */
+static int sw_prepare_video_conversion(StreamWriter* writer, AVFrame* frame)
 {
-    AVPacket* pkt = av_packet_alloc();
-    int stNum = get_stream_number(writer->output_context, AVMEDIA_TYPE_VIDEO);
+    AVCodecContext* c = writer->video_encoder;
 
-    AVFrame* frame = frames;
-
-    AVFrame* tmp = av_frame_alloc();
-    if (!tmp) {
-        fprintf(stderr, "Could not allocate the frame\n");
-        return -1;
-    }
-
-    int ret;
-
-    static struct SwsContext* sws_ctx = NULL;
-    sws_ctx = sws_getContext(frame->width, frame->height, frame->format,
-        writer->video_encoder->width, writer->video_encoder->height, writer->video_encoder->pix_fmt,
-        SWS_BICUBIC, NULL, NULL, NULL);
-
-    if (!sws_ctx) {
-        fprintf(stderr, "sws_getContext was not initialized\n");
-        return -1;
+    if (writer->scaler == NULL)
+    {
+        writer->scaler = fs_alloc(0);
+        if (writer->scaler == NULL)
+        {
+            fprintf(stderr, "Could not allocate the frame scaler\n");
+            return -1;
+        }
     }
 
-    tmp->format = writer->video_encoder->pix_fmt;
-    tmp->width = writer->video_encoder->width;
-    tmp->height = writer->video_encoder->height;
-    tmp->pts = writer->latest_video_pts;
-
-    av_frame_get_buffer(tmp, 0);
-
-    for (int i = 0; i < nb_frames; i++)
+    if (writer->video_frame == NULL)
     {
-        frame = frames;
-        ret = sws_scale(sws_ctx,
-            frame->data,
-            frame->linesize,
-            0,
-            frame->height,
-            tmp->data,
-            tmp->linesize);
-        if (ret < 0)
+        writer->video_frame = av_frame_alloc();
+        if (writer->video_frame == NULL)
         {
-            fprintf(stderr, "sws_scale error: %s\n", av_err2str(ret));
+            fprintf(stderr, "Could not allocate the frame\n");
             return -1;
         }
 
-        tmp->pts = writer->latest_video_pts;
+        writer->video_frame->format = c->pix_fmt;
+        writer->video_frame->width = c->width;
+        writer->video_frame->height = c->height;
 
-        ret = write_frame(writer->output_context, writer->video_encoder, writer->output_context->streams[stNum], tmp, pkt);
+        int ret = av_frame_get_buffer(writer->video_frame, 0);
         if (ret < 0)
         {
-            fprintf(stderr, "write_frame error: %s\n", av_err2str(ret));
+            fprintf(stderr, "Could not allocate the frame data: %s\n", av_err2str(ret));
+            av_frame_free(&writer->video_frame);
             return -1;
         }
-
-        writer->latest_video_pts += 1;
-        
-        frames++;
     }
 
-    av_frame_free(&tmp);
+    return 0;
+}
+
+/**
+ * Send the frame to the encoder as is. The writer takes only a new reference to the frame for the timestamp,
+ * the data is not copied (unless the frame is not reference counted).
+ */
+static int sw_pass_frame(StreamWriter* writer, AVCodecContext* c, int stream_index, AVFrame* frame, int64_t pts,
+    AVPacket* pkt)
+{
+    AVFrame* ref = writer->passthrough_frame;
 
-    if (sws_ctx != NULL)
+    int ret = av_frame_ref(ref, frame);
+    if (ret < 0)
     {
-        sws_freeContext(sws_ctx);
+        fprintf(stderr, "Could not reference the frame: %s\n", av_err2str(ret));
+        return ret;
     }
 
-    av_packet_free(&pkt);
+    ref->pts = pts;
 
-    return 0;
-}
+    // Picture type of the decoded frames would force the key frames of the encoder.
+    ref->pict_type = AV_PICTURE_TYPE_NONE;
 
-int sw_write_audio_frames(StreamWriter* writer, AVFrame* frames, int nb_frames)
-{
-    AVPacket* pkt = av_packet_alloc();
-    int stNum = get_stream_number(writer->output_context, AVMEDIA_TYPE_AUDIO);
+    int64_t start = ss_now();
+    ret = write_frame(writer->output_context, c, writer->output_context->streams[stream_index], ref, pkt);
+    ss_record(&writer->stats[SW_STAGE_ENCODE], start, 0);
 
-    AVFrame* frame = frames;
+    // Encoder keeps its own reference as long as it needs the frame.
+    av_frame_unref(ref);
 
-    AVFrame* tmp = av_frame_alloc();
-    if (!tmp) {
-        fprintf(stderr, "Could not allocate the frame\n");
-        return -1;
+    if (ret < 0)
+    {
+        fprintf(stderr, "write_frame error: %s\n", av_err2str(ret));
     }
 
+    return ret;
+}
+
+static int sw_write_video_frame(StreamWriter* writer, AVFrame* frame)
+{
+    AVCodecContext* c = writer->video_encoder;
+    int stNum = get_stream_number(writer->output_context, AVMEDIA_TYPE_VIDEO);
+
     int ret;
 
-    static struct SwrContext* swr_ctx = NULL;
-    uint8_t** converted_input_samples = NULL;
-    AVAudioFifo* fifo = NULL;
+    if (frame->width == c->width && frame->height == c->height && frame->format == c->pix_fmt)
+    {
+        ret = sw_pass_frame(writer, c, stNum, frame, writer->latest_video_pts, writer->video_packet);
+        if (ret < 0)
+        {
+            return -1;
+        }
 
-    /*
-        * Perform a sanity check so that the number of converted samples is
-        * not greater than the number of samples to be converted.
-        * If the sample rates differ, this case has to be handled differently
-        */
-    av_assert0(frame->sample_rate == writer->audio_encoder->sample_rate);
+        writer->latest_video_pts += 1;
 
-    swr_ctx = swr_alloc();
+        return 0;
+    }
 
-    int src_channel_layout = frame->channel_layout;
-    if (src_channel_layout == 0)
+    if (sw_prepare_video_conversion(writer, frame) < 0)
     {
-        src_channel_layout = av_get_default_channel_layout(frame->channels);
+        return -1;
     }
-    av_opt_set_channel_layout(swr_ctx, "in_channel_layout", src_channel_layout, 0);
-    av_opt_set_channel_layout(swr_ctx, "out_channel_layout", writer->audio_encoder->channel_layout, 0);
-    av_opt_set_int(swr_ctx, "in_sample_rate", frame->sample_rate, 0);
-    av_opt_set_int(swr_ctx, "out_sample_rate", writer->audio_encoder->sample_rate, 0);
-    av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", frame->format, 0);
-    av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", writer->audio_encoder->sample_fmt, 0);
-    ret = swr_init(swr_ctx);
-    if (ret < 0) {
-        fprintf(stderr, "swr_init error: %s\n", av_err2str(ret));
+
+    AVFrame* tmp = writer->video_frame;
+    AVPacket* pkt = writer->video_packet;
+
+    // Encoder could still hold a reference to the previous frame, only then a new buffer is allocated.
+    ret = av_frame_make_writable(tmp);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not make the frame writable: %s\n", av_err2str(ret));
         return -1;
     }
 
-    tmp->channels = writer->audio_encoder->channels;
-    tmp->channel_layout = writer->audio_encoder->channel_layout;
-    tmp->sample_rate = writer->audio_encoder->sample_rate;
-    tmp->format = writer->audio_encoder->sample_fmt;
-    tmp->nb_samples = writer->audio_encoder->frame_size;
-    /* Allocate the samples of the created frame. This call will make
-     * sure that the audio frame can hold as many samples as specified. */
-    if ((ret = av_frame_get_buffer(tmp, 0)) < 0) 
+    int64_t start = ss_now();
+    ret = fs_scale(writer->scaler, frame, tmp);
+    ss_record(&writer->stats[SW_STAGE_SCALE], start, 0);
+    if (ret < 0)
     {
-        fprintf(stderr, "Could not allocate output frame samples (error '%s')\n", av_err2str(ret));
-        av_frame_free(tmp);
         return -1;
     }
 
-    fifo = av_audio_fifo_alloc(writer->audio_encoder->sample_fmt, writer->audio_encoder->channels, 1);
-    if (fifo == NULL)
+    tmp->pts = writer->latest_video_pts;
+
+    start = ss_now();
+    ret = write_frame(writer->output_context, c, writer->output_context->streams[stNum], tmp, pkt);
+    ss_record(&writer->stats[SW_STAGE_ENCODE], start, 0);
+    if (ret < 0)
     {
-        fprintf(stderr, "Could not allocate FIFO\n");
+        fprintf(stderr, "write_frame error: %s\n", av_err2str(ret));
         return -1;
     }
 
+    writer->latest_video_pts += 1;
+
+    return 0;
+}
+
+int sw_write_video_frames(StreamWriter* writer, AVFrame* frames, int nb_frames)
+{
     for (int i = 0; i < nb_frames; i++)
     {
-        frame = frames;
-        ret = init_converted_samples(&converted_input_samples, writer->audio_encoder, frame->nb_samples);
-        if (ret < 0)
+        if (sw_write_video_frame(writer, &frames[i]) < 0)
         {
-            fprintf(stderr, "swr_convert_frame error: %s\n", av_err2str(ret));
             return -1;
         }
+    }
+
+    return 0;
+}
+
+/**
+ * Encode the samples of the FIFO by whole encoder frames. The rest stays in the FIFO for the next call,
+ * unless it is the final flush and the encoder accepts a smaller last frame.
+ */
+static int sw_encode_audio_fifo(StreamWriter* writer, int final)
+{
+    AVCodecContext* c = writer->audio_encoder;
+    int stNum = get_stream_number(writer->output_context, AVMEDIA_TYPE_AUDIO);
+    int frame_size = sw_get_audio_frame_size(writer);
+    AVFrame* tmp = writer->audio_frame;
+
+    while (av_audio_fifo_size(writer->audio_fifo) >= frame_size
+        || (final && av_audio_fifo_size(writer->audio_fifo) > 0
+            && (c->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE))))
+    {
+        // Encoder could still hold a reference to the previous frame, only then a new buffer is allocated.
+        int ret = av_frame_make_writable(tmp);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Could not make the frame writable: %s\n", av_err2str(ret));
+            return ret;
+        }
 
-        /* Convert the input samples to the desired output sample format.
-            * This requires a temporary storage provided by converted_input_samples. */
-        if (convert_samples((const uint8_t**)frame->extended_data, converted_input_samples, frame->nb_samples, swr_ctx) < 0)
+        tmp->nb_samples = FFMIN(av_audio_fifo_size(writer->audio_fifo), frame_size);
+        tmp->pts = writer->latest_audio_pts;
+
+        /* Read as many samples from the FIFO buffer as required to fill the frame.
+         * The samples are stored in the frame temporarily. */
+        if (av_audio_fifo_read(writer->audio_fifo, (void**)tmp->data, tmp->nb_samples) < tmp->nb_samples)
         {
-            return -1;
+            fprintf(stderr, "Could not read data from FIFO\n");
+            return AVERROR_EXIT;
         }
 
-        /* Add the converted input samples to the FIFO buffer for later processing. */
-        if (add_samples_to_fifo(fifo, converted_input_samples, frame->nb_samples) < 0)
+        int64_t start = ss_now();
+        ret = write_frame(writer->output_context, c, writer->output_context->streams[stNum], tmp, writer->audio_packet);
+        ss_record(&writer->stats[SW_STAGE_ENCODE], start, 0);
+        if (ret < 0)
         {
-            return -1;
+            fprintf(stderr, "write_frame error: %s\n", av_err2str(ret));
+            return ret;
         }
 
-        frames++;
+        writer->latest_audio_pts += tmp->nb_samples;
     }
 
-    /* If we have enough samples for the encoder, we encode them.
-         * At the end of the file, we pass the remaining samples to
-         * the encoder. */
-    while (av_audio_fifo_size(fifo) >= writer->audio_encoder->frame_size)
+    tmp->nb_samples = frame_size;
+
+    return 0;
+}
+
+/**
+ * Check if the frame could be sent to the encoder as is. The samples which wait in the resampler or in the FIFO
+ * must be encoded first, so the frames are passed only when both are empty.
+ */
+static int sw_audio_frame_matches(StreamWriter* writer, const AVFrame* frame)
+{
+    AVCodecContext* c = writer->audio_encoder;
+
+    int64_t channel_layout = frame->channel_layout;
+    if (channel_layout == 0)
     {
-        tmp->pts = writer->latest_audio_pts;
+        channel_layout = av_get_default_channel_layout(frame->channels);
+    }
 
-        /* Read as many samples from the FIFO buffer as required to fill the frame.
-         * The samples are stored in the frame temporarily. */
-        if (av_audio_fifo_read(fifo, (void**)tmp->data, writer->audio_encoder->frame_size) < writer->audio_encoder->frame_size) 
+    return frame->format == c->sample_fmt && frame->sample_rate == c->sample_rate
+        && channel_layout == c->channel_layout
+        && (frame->nb_samples == c->frame_size || (c->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        && (writer->audio_fifo == NULL || av_audio_fifo_size(writer->audio_fifo) == 0)
+        && (writer->swr_context == NULL || swr_get_delay(writer->swr_context, c->sample_rate) == 0);
+}
+
+/**
+ * Convert the frame to the FIFO, or pass it to the encoder if it already has the encoder format.
+ */
+static int sw_write_audio_frame(StreamWriter* writer, AVFrame* frame)
+{
+    if (sw_audio_frame_matches(writer, frame))
+    {
+        int stNum = get_stream_number(writer->output_context, AVMEDIA_TYPE_AUDIO);
+        int ret = sw_pass_frame(writer, writer->audio_encoder, stNum, frame, writer->latest_audio_pts,
+            writer->audio_packet);
+        if (ret < 0)
         {
-            fprintf(stderr, "Could not read data from FIFO\n");
             return -1;
         }
 
-        write_frame(writer->output_context, writer->audio_encoder, writer->output_context->streams[stNum], tmp, pkt);
-        writer->latest_audio_pts += tmp->nb_samples;
+        writer->latest_audio_pts += frame->nb_samples;
+
+        return 0;
     }
 
-    av_frame_free(&tmp);
+    if (sw_prepare_audio_conversion(writer, frame) < 0)
+    {
+        return -1;
+    }
 
-    if (swr_ctx != NULL)
+    // Resampler could produce more samples than it is given (it keeps the delayed ones).
+    if (sw_reserve_converted_samples(writer, swr_get_out_samples(writer->swr_context, frame->nb_samples)) < 0)
     {
-        swr_free(&swr_ctx);
+        return -1;
     }
 
-    if (converted_input_samples)
+    /* Convert the input samples to the desired output sample format.
+     * This requires a temporary storage provided by converted_samples. */
+    int64_t start = ss_now();
+    int converted = convert_samples((const uint8_t**)frame->extended_data, frame->nb_samples,
+        writer->converted_samples, writer->converted_capacity, writer->swr_context);
+    ss_record(&writer->stats[SW_STAGE_RESAMPLE], start, 0);
+    if (converted < 0)
     {
-        av_freep(&converted_input_samples[0]);
-        free(converted_input_samples);
+        return -1;
     }
 
-    av_audio_fifo_free(&fifo);
+    /* Add the converted input samples to the FIFO buffer for later processing. */
+    if (add_samples_to_fifo(writer->audio_fifo, writer->converted_samples, converted) < 0)
+    {
+        return -1;
+    }
 
-    av_packet_free(&pkt);
+    /* If we have enough samples for the encoder, we encode them.
+     * The rest is carried over to the next frame. */
+    if (sw_encode_audio_fifo(writer, 0) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int sw_write_audio_frames(StreamWriter* writer, AVFrame* frames, int nb_frames)
+{
+    for (int i = 0; i < nb_frames; i++)
+    {
+        if (sw_write_audio_frame(writer, &frames[i]) < 0)
+        {
+            return -1;
+        }
+    }
 
     return 0;
 }
@@ -551,4 +814,85 @@ int sw_write_frames(StreamWriter* writer, enum AVMediaType type, AVFrame* frames
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int sw_write_frame_batch(StreamWriter* writer, enum AVMediaType type, AVFrame** frames, int nb_frames)
+{
+    for (int i = 0; i < nb_frames; i++)
+    {
+        int ret = 0;
+        if (type == AVMEDIA_TYPE_AUDIO)
+        {
+            ret = sw_write_audio_frame(writer, frames[i]);
+        }
+        else if (type == AVMEDIA_TYPE_VIDEO)
+        {
+            ret = sw_write_video_frame(writer, frames[i]);
+        }
+
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int sw_write_packet(StreamWriter* writer, enum AVMediaType type, const AVPacket* pkt, AVRational time_base)
+{
+    int stNum = get_stream_number(writer->output_context, type);
+    if (stNum < 0)
+    {
+        fprintf(stderr, "There is no %s stream\n", av_get_media_type_string(type));
+        return -1;
+    }
+
+    AVStream* st = writer->output_context->streams[stNum];
+    AVPacket* ref = writer->passthrough_packet;
+
+    int ret = av_packet_ref(ref, pkt);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not reference the packet: %s\n", av_err2str(ret));
+        return -1;
+    }
+
+    /* rescale packet timestamp values from the input stream to the output stream timebase */
+    av_packet_rescale_ts(ref, time_base, st->time_base);
+    ref->stream_index = stNum;
+    ref->pos = -1;
+
+    /* the muxer takes over the reference */
+    int64_t start = ss_now();
+    int size = ref->size;
+    ret = av_interleaved_write_frame(writer->output_context, ref);
+    ss_record(&writer->stats[SW_STAGE_WRITE_PACKET], start, size);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+int sw_get_stage_stats(StreamWriter* writer, enum StreamWriterStage stage, StageStatsSummary* summary)
+{
+    if (stage < 0 || stage >= SW_NB_STAGES)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    ss_get_summary(&writer->stats[stage], summary);
+
+    return 0;
+}
+
+void sw_print_stats(StreamWriter* writer)
+{
+    for (int i = 0; i < SW_NB_STAGES; i++)
+    {
+        ss_print(&writer->stats[i]);
+    }
+}
@@ -4,7 +4,30 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/avassert.h>
 #include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
 #include "framework.h"
+#include "frame-scaler.h"
+#include "stage-stats.h"
+#include "utils.h"
+
+// Samples per frame which are passed to the audio encoders with a variable frame size.
+#define SW_DEFAULT_AUDIO_FRAME_SIZE 1024
+
+enum StreamWriterStage {
+    // Conversion of a video frame to the encoder format.
+    SW_STAGE_SCALE,
+
+    // Conversion of an audio frame to the encoder format.
+    SW_STAGE_RESAMPLE,
+
+    // Sending a frame to the encoder and muxing its packets.
+    SW_STAGE_ENCODE,
+
+    // Muxing of an encoded packet (sw_write_packet), bytes are the packet sizes.
+    SW_STAGE_WRITE_PACKET,
+
+    SW_NB_STAGES,
+};
 
 typedef struct StreamWriter {
 
@@ -12,26 +35,96 @@ typedef struct StreamWriter {
     AVCodecContext* video_encoder;
     int video_stream_index;
     int64_t latest_video_pts;
+
+    // Conversion of the video frames to the encoder format. It lives as long as the writer and is rebuilt
+    // only when the geometry or the pixel format of the source frames changes. Frames are scaled in bands
+    // by the worker pool of the scaler.
+    FrameScaler* scaler;
+    AVFrame* video_frame;
+    AVPacket* video_packet;
     AVCodecContext* audio_encoder;
     int audio_stream_index;
     int64_t latest_audio_pts;
 
+    // Conversion of the audio frames to the encoder format. It lives as long as the audio stream and is rebuilt
+    // only when the source format changes. Samples which do not fill a whole encoder frame stay in the FIFO
+    // until the next call.
+    struct SwrContext* swr_context;
+    int64_t swr_channel_layout;
+    int swr_sample_rate;
+    enum AVSampleFormat swr_format;
+    AVAudioFifo* audio_fifo;
+    uint8_t** converted_samples;
+    int converted_capacity;
+    AVFrame* audio_frame;
+    AVPacket* audio_packet;
+
+    // Reference to the frame which is passed to the encoder without the conversion.
+    AVFrame* passthrough_frame;
+
+    // Reference to the encoded packet which is written without the encoder.
+    AVPacket* passthrough_packet;
+
     const char* output;
 
+    // Latency of the stages since the writer was allocated.
+    StageStats stats[SW_NB_STAGES];
+
 } StreamWriter;
 
 EXPORT StreamWriter* sw_allocate_writer(const char* output, const char* format);
 
 EXPORT StreamWriter* sw_allocate_writer_from_format(const char* output, const AVOutputFormat* oformat);
 
-EXPORT int sw_allocate_video_stream(StreamWriter* writer, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format);
+/**
+ * Add the video stream. The encoder is set up by the profile, the options (e.g. "preset", "threads", "g")
+ * are passed to the encoder and override the profile.
+ */
+EXPORT int sw_allocate_video_stream(StreamWriter* writer, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format,
+    enum EncoderProfile profile, const AVDictionary* opts);
 
 EXPORT int sw_allocate_audio_stream(StreamWriter* writer, enum AVCodecID codecId, int64_t bit_rate, int sample_rate, int channel_layout, enum AVSampleFormat sample_fmt);
 
+/**
+ * Add the stream of the already encoded packets, e.g. the stream of the reader input. No encoder is opened,
+ * the packets are written by sw_write_packet.
+ * @param time_base Time base of the packets.
+ */
+EXPORT int sw_allocate_stream_from_parameters(StreamWriter* writer, const AVCodecParameters* par, AVRational time_base);
+
 EXPORT int sw_write_frames(StreamWriter* writer, enum AVMediaType type, AVFrame* frames, int nb_frames);
 
+/**
+ * Write the frames of the stream of the specified type. Frames which already have the size and the format
+ * of the encoder (the sample format, rate and layout for audio) are passed to the encoder by reference,
+ * without a conversion and a copy. The frames stay owned by the caller.
+ * @return Error code (0 if successful)
+ */
+EXPORT int sw_write_frame_batch(StreamWriter* writer, enum AVMediaType type, AVFrame** frames, int nb_frames);
+
 EXPORT int sw_open_writer(StreamWriter* writer, AVDictionary** options);
 
+/**
+ * Flush the encoders, write the trailer and free the writer resources. The writer is closed even on error.
+ * @return 0 on success, a negative AVERROR if the audio left in the FIFO could not be encoded.
+ */
 EXPORT int sw_close_writer(StreamWriter* writer);
 
-EXPORT int sw_free_writer(StreamWriter** writer);
\ No newline at end of file
+EXPORT int sw_free_writer(StreamWriter** writer);
+
+/**
+ * Write the encoded packet to the stream of the type, its timestamps are rescaled from the time base
+ * to the one of the stream. The packet stays owned by the caller, the writer takes a new reference to it.
+ * @return Error code (0 if successful)
+ */
+EXPORT int sw_write_packet(StreamWriter* writer, enum AVMediaType type, const AVPacket* pkt, AVRational time_base);
+
+/**
+ * @return 0 on success, AVERROR(EINVAL) if there is no such stage.
+ */
+EXPORT int sw_get_stage_stats(StreamWriter* writer, enum StreamWriterStage stage, StageStatsSummary* summary);
+
+/**
+ * Print the summary of all the stages to stdout.
+ */
+EXPORT void sw_print_stats(StreamWriter* writer);
@@ -33,7 +33,7 @@ uint64_t select_channel_layout(const AVCodec* codec)
     return best_ch_layout;
 }
 
-int open_codec_context(int* streamIndex, AVCodecContext** decCtx, AVFormatContext* inputFormat, enum AVMediaType type)
+int open_codec_context(int* streamIndex, AVCodecContext** decCtx, AVFormatContext* inputFormat, enum AVMediaType type, const AVDictionary* opts)
 {
     int ret, stream_index;
     AVStream* st;
@@ -72,8 +72,17 @@ int open_codec_context(int* streamIndex, AVCodecContext** decCtx, AVFormatContex
             return ret;
         }
 
+        /* Every decoder gets its own copy of the options, the threads are picked by the core count by default
+         * (the codec default is a single thread). */
+        AVDictionary* dec_opts = NULL;
+        av_dict_copy(&dec_opts, opts, 0);
+        if (!av_dict_get(dec_opts, "threads", NULL, 0))
+            av_dict_set(&dec_opts, "threads", "auto", 0);
+
         /* Init the decoders */
-        if ((ret = avcodec_open2(*decCtx, dec, NULL)) < 0) {
+        ret = avcodec_open2(*decCtx, dec, &dec_opts);
+        av_dict_free(&dec_opts);
+        if (ret < 0) {
             fprintf(stderr, "Failed to open %s codec\n",
                 av_get_media_type_string(type));
             return ret;
@@ -234,9 +243,8 @@ int convert_audio_frame(AVFrame* src, AVFrame* dest)
 
 int convert_video_frame(AVFrame* src, AVFrame* dest)
 {
-    static struct SwsContext* sws_ctx;
-
-    sws_ctx = sws_getContext(src->width, src->height, src->format,
+    // One-off conversion, starting the threads of a FrameScaler would cost more than the parallel scaling saves.
+    struct SwsContext* sws_ctx = sws_getContext(src->width, src->height, src->format,
         dest->width, dest->height, dest->format,
         SWS_BICUBIC, NULL, NULL, NULL);
 
@@ -244,8 +252,8 @@ int convert_video_frame(AVFrame* src, AVFrame* dest)
         return -1;
     }
 
-    sws_scale(sws_ctx,
-        src->data,
+    int ret = sws_scale(sws_ctx,
+        (const uint8_t* const*)src->data,
         src->linesize,
         0,
         src->height,
@@ -254,7 +262,7 @@ int convert_video_frame(AVFrame* src, AVFrame* dest)
 
     sws_freeContext(sws_ctx);
 
-    return 0;
+    return ret < 0 ? -1 : 0;
 }
 
 void encode_frame_to_file(AVCodecContext* enc_ctx, AVFrame* frame, AVPacket* pkt, FILE* outfile)
@@ -391,7 +399,62 @@ int free_frames(AVFrame* frames, int64_t nb_frames)
     return 0;
 }
 
-AVCodecContext* allocate_video_stream(AVFormatContext* avf, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format)
+void set_encoder_profile(AVCodecContext* c, const AVCodec* codec, enum EncoderProfile profile, AVDictionary** opts)
+{
+    int x26x = !strcmp(codec->name, "libx264") || !strcmp(codec->name, "libx265");
+    int fps = c->framerate.num > 0 && c->framerate.den > 0 ? (int)(av_q2d(c->framerate) + 0.5) : 30;
+
+    /* a thread per core */
+    c->thread_count = 0;
+
+    switch (profile) {
+    case ENCODER_PROFILE_LOW_LATENCY:
+        /* frames are not reordered or queued for the frame threads,
+         * each one leaves the encoder as soon as it is encoded */
+        c->gop_size = fps;
+        c->max_b_frames = 0;
+        c->thread_type = FF_THREAD_SLICE;
+        c->rc_max_rate = c->bit_rate;
+        c->rc_buffer_size = (int)FFMIN(c->bit_rate, INT_MAX);
+        if (x26x) {
+            av_dict_set(opts, "preset", "veryfast", AV_DICT_DONT_OVERWRITE);
+            av_dict_set(opts, "tune", "zerolatency", AV_DICT_DONT_OVERWRITE);
+        }
+        break;
+    case ENCODER_PROFILE_BALANCED:
+        c->gop_size = 2 * fps;
+        c->max_b_frames = 2;
+        c->rc_max_rate = c->bit_rate * 3 / 2;
+        c->rc_buffer_size = (int)FFMIN(c->bit_rate * 2, INT_MAX);
+        if (x26x)
+            av_dict_set(opts, "preset", "faster", AV_DICT_DONT_OVERWRITE);
+        break;
+    case ENCODER_PROFILE_ARCHIVAL:
+        /* CRF takes over the average bitrate, which stays the base of the cap */
+        c->gop_size = 4 * fps;
+        c->max_b_frames = 3;
+        c->rc_max_rate = c->bit_rate * 2;
+        c->rc_buffer_size = (int)FFMIN(c->bit_rate * 4, INT_MAX);
+        if (x26x) {
+            av_dict_set(opts, "preset", "slow", AV_DICT_DONT_OVERWRITE);
+            av_dict_set(opts, "crf", "18", AV_DICT_DONT_OVERWRITE);
+        }
+        break;
+    default:
+        /* emit one intra frame every ten frames
+         * check frame pict_type before passing frame
+         * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
+         * then gop_size is ignored and the output of encoder
+         * will always be I frame irrespective to gop_size
+         */
+        c->gop_size = 10;
+        c->max_b_frames = 1;
+        break;
+    }
+}
+
+AVCodecContext* allocate_video_stream(AVFormatContext* avf, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format,
+    enum EncoderProfile profile, const AVDictionary* opts)
 {
     AVCodecContext* c = NULL;
 
@@ -427,29 +490,25 @@ AVCodecContext* allocate_video_stream(AVFormatContext* avf, enum AVCodecID codec
 
     st->time_base = c->time_base;
 
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    c->gop_size = 10;
-    c->max_b_frames = 1;
     c->pix_fmt = pixel_format;
 
-    if (codec == AV_CODEC_ID_H264)
-        av_opt_set(c->priv_data, "preset", "slow", 0);
+    /* options of the caller take precedence over the profile */
+    AVDictionary* enc_opts = NULL;
+    av_dict_copy(&enc_opts, opts, 0);
+    set_encoder_profile(c, codec, profile, &enc_opts);
+
+    /* Some formats want stream headers to be separate. */
+    if (avf->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     /* open it */
-    if (avcodec_open2(c, codec, NULL) < 0) {
+    int ret = avcodec_open2(c, codec, &enc_opts);
+    av_dict_free(&enc_opts);
+    if (ret < 0) {
         fprintf(stderr, "Could not open codec\n");
         return NULL;
     }
 
-    /* Some formats want stream headers to be separate. */
-    if (avf->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
     avcodec_parameters_from_context(st->codecpar, c);
 
     return c;
@@ -495,16 +554,16 @@ AVCodecContext* allocate_audio_stream(AVFormatContext* avf, enum AVCodecID codec
     c->sample_rate = select_sample_rate(codec);
     c->channel_layout = channel_layout;
 
+    /* Some formats want stream headers to be separate. */
+    if (avf->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
     /* open it */
     if (avcodec_open2(c, codec, NULL) < 0) {
         fprintf(stderr, "Could not open codec\n");
         return -1;
     }
 
-    /* Some formats want stream headers to be separate. */
-    if (avf->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
     st->time_base = (AVRational){ 1, c->sample_rate };
 
     avcodec_parameters_from_context(st->codecpar, c);
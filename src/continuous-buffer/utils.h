@@ -15,9 +15,31 @@
 #include "framework.h"
 #include "continuous-buffer.h"
 
+/**
+ * Tuning of the video encoders. Preset and tune are applied to libx264 and libx265 only,
+ * the other settings to any encoder.
+ */
+enum EncoderProfile {
+    // GOP of 10 frames with a single B-frame.
+    ENCODER_PROFILE_DEFAULT,
+
+    // Live capture: no B-frames, slice threads only and a 1 second GOP, the VBV buffer holds 1 second.
+    ENCODER_PROFILE_LOW_LATENCY,
+
+    // Replay buffer: cheap preset, a 2 second GOP and the bitrate capped at 1.5x of the average.
+    ENCODER_PROFILE_BALANCED,
+
+    // Saved clips: constant quality with a 4 second GOP, the bitrate is only capped at 2x.
+    ENCODER_PROFILE_ARCHIVAL,
+};
+
 EXPORT int check_sample_fmt(const AVCodec* codec, enum AVSampleFormat sample_fmt);
 
-EXPORT int open_codec_context(int* streamIndex, AVCodecContext** decCtx, AVFormatContext* inputFormat, enum AVMediaType type);
+/**
+ * Open the decoder of the best stream of the type. The options are passed to the decoder, "threads" is "auto"
+ * unless the options set it.
+ */
+EXPORT int open_codec_context(int* streamIndex, AVCodecContext** decCtx, AVFormatContext* inputFormat, enum AVMediaType type, const AVDictionary* opts);
 
 EXPORT int select_sample_rate(const AVCodec* codec);
 
@@ -42,6 +64,14 @@ EXPORT AVDeviceInfoList* get_devices_list(const char* format);
 
 EXPORT int free_frames(AVFrame* frames, int64_t nb_frames);
 
-EXPORT AVCodecContext* allocate_video_stream(AVFormatContext* avf, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format);
+/**
+ * Set up the encoder context for the profile. GOP, B-frames, threads and the rate control are set on the context,
+ * the private options of the encoder are added to the options unless they are already set there.
+ * The time base, the frame rate and the bit rate must be set before.
+ */
+EXPORT void set_encoder_profile(AVCodecContext* c, const AVCodec* codec, enum EncoderProfile profile, AVDictionary** opts);
+
+EXPORT AVCodecContext* allocate_video_stream(AVFormatContext* avf, enum AVCodecID codecId, AVRational time_base, int64_t bit_rate, int width, int height, enum AVPixelFormat pixel_format,
+    enum EncoderProfile profile, const AVDictionary* opts);
 
 EXPORT AVCodecContext* allocate_audio_stream(AVFormatContext* avf, enum AVCodecID codecId, int64_t bit_rate, int sample_rate, int channel_layout, enum AVSampleFormat sample_fmt);
\ No newline at end of file